@@ -0,0 +1,31 @@
+#!/bin/sh
+# Create, chmod, chown and remove N files (6000 by default) in one directory
+# of an upfs-ps mount, with and without journal, timing each step. Each
+# change rewrites an entry of the directory's .upfs in place, or appends to
+# its journal. Put STORE_DIR on the flash being measured.
+. "$(dirname "$0")/lib.sh"
+N=${N:-6000}
+
+printf '%-10s %8s %8s %8s %8s %8s %12s\n' mode create chmod chown rm \
+    appends checkpoints
+for mode in default journal; do
+    opts=
+    if [ $mode = journal ]; then
+        opts=journal
+    fi
+
+    bench_setup
+    bench_mount ps "$opts"
+    names=$BENCH_DIR/names
+    seq -f "$MNT/file%g" "$N" > "$names"
+    create=$(bench_time xargs touch < "$names")
+    chmod=$(bench_time xargs chmod 600 < "$names")
+    chown=$(bench_time xargs chown "$(id -u):$(id -g)" < "$names")
+    rm=$(bench_time xargs rm < "$names")
+    bench_umount
+    rm -f "$names"
+
+    printf '%-10s %8s %8s %8s %8s %8s %12s\n' $mode "$create" "$chmod" \
+        "$chown" "$rm" "$(bench_stat journal_append)" \
+        "$(bench_stat journal_checkpoint)"
+done
@@ -0,0 +1,86 @@
+# Shared by the benchmarks: scratch directories, and mounting upfs or upfs-ps
+# over them with statistics. Source it from a benchmark script.
+#
+# UPFS and UPFS_PS name the binaries to use, ./upfs and ./upfs-ps by default.
+# The store goes in STORE_DIR, to put it on the media being measured, and
+# everything else in BENCH_DIR, /tmp/upfs-bench by default. Run as root to
+# drop the page cache between runs; otherwise the store may be read warm.
+
+UPFS=${UPFS:-./upfs}
+UPFS_PS=${UPFS_PS:-./upfs-ps}
+BENCH_DIR=${BENCH_DIR:-/tmp/upfs-bench}
+STORE_DIR=${STORE_DIR:-$BENCH_DIR}
+PERM=$BENCH_DIR/perm
+STORE=$STORE_DIR/store
+MNT=$BENCH_DIR/mnt
+STATS=$BENCH_DIR/stats
+
+bench_clean() {
+    if mountpoint -q "$MNT"; then
+        fusermount3 -u "$MNT"
+    fi
+    rm -rf "$PERM" "$STORE" "$STATS"
+}
+
+# Fresh, empty perm and store directories
+bench_setup() {
+    bench_clean
+    mkdir -p "$PERM" "$STORE" "$MNT"
+}
+
+trap bench_clean EXIT
+
+# Mount upfs with the given options, or upfs-ps if the first argument is "ps".
+# Statistics are written when it's unmounted.
+bench_mount() {
+    rm -f "$STATS"
+    if [ "$1" = ps ]; then
+        shift
+        "$UPFS_PS" "$STORE" "$MNT" -f -o "stats_file=$STATS${1:+,$1}" &
+    else
+        "$UPFS" "$PERM" "$STORE" "$MNT" -f -o "stats_file=$STATS${1:+,$1}" &
+    fi
+    BENCH_PID=$!
+    while ! mountpoint -q "$MNT"; do
+        kill -0 $BENCH_PID 2>/dev/null || return 1
+        sleep 0.1
+    done
+}
+
+# The CPU time upfs has used so far, in seconds
+bench_cpu() {
+    awk -v hz="$(getconf CLK_TCK)" '{ print ($14 + $15) / hz }' \
+        /proc/$BENCH_PID/stat
+}
+
+bench_umount() {
+    BENCH_CPU=$(bench_cpu)
+    fusermount3 -u "$MNT"
+    wait $BENCH_PID
+}
+
+# A counter from the statistics of the last mount
+bench_stat() {
+    awk -v name="$1" '$1 == name { print $2 }' "$STATS"
+}
+
+# The sum of the per-worker request counts from the last mount
+bench_requests() {
+    awk '/^worker_.*_requests / || /^workers_retired_requests / { n += $2 }
+        END { print n + 0 }' "$STATS"
+}
+
+bench_drop_caches() {
+    sync
+    if [ -w /proc/sys/vm/drop_caches ]; then
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+}
+
+# Run a command, discarding its output, and print how long it took in seconds
+bench_time() {
+    bench_start=$(date +%s.%N)
+    "$@" > /dev/null
+    bench_end=$(date +%s.%N)
+    awk -v s="$bench_start" -v e="$bench_end" 'BEGIN { printf "%.3f\n", e - s }'
+}
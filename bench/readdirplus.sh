@@ -0,0 +1,21 @@
+#!/bin/sh
+# List a directory of N photos (20000 by default) with ls -l, with each
+# readdirplus mode, and count the upcalls it took. Without readdirplus, each
+# name costs a lookup and usually a getattr of its own.
+. "$(dirname "$0")/lib.sh"
+N=${N:-20000}
+
+bench_setup
+(cd "$STORE" && seq -f 'IMG_%05g.JPG' "$N" | xargs touch)
+
+printf '%-10s %8s %8s %8s %8s %12s\n' readdirplus seconds lookup getattr \
+    readdir readdirplus
+for mode in no yes auto; do
+    bench_drop_caches
+    bench_mount "readdirplus=$mode"
+    t=$(bench_time ls -l "$MNT")
+    bench_umount
+    printf '%-10s %8s %8s %8s %8s %12s\n' "$mode" "$t" \
+        "$(bench_stat lookup)" "$(bench_stat getattr)" \
+        "$(bench_stat readdir)" "$(bench_stat readdirplus)"
+done
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Read a tree of JOBS directories of FILES small files each (nproc and 500 by
+# default), one reader per directory at once, as a parallel build would,
+# with 1 up to MAX_THREADS (nproc) FUSE workers on cloned queues, then the
+# most on one shared queue.
+. "$(dirname "$0")/lib.sh"
+JOBS=${JOBS:-$(nproc)}
+FILES=${FILES:-500}
+MAX_THREADS=${MAX_THREADS:-$(nproc)}
+
+readers() {
+    for j in $(seq "$JOBS"); do
+        find "$MNT/job$j" -type f -exec cat {} + > /dev/null &
+    done
+    wait
+}
+
+bench_setup
+for j in $(seq "$JOBS"); do
+    mkdir -p "$STORE/job$j/src"
+    (cd "$STORE/job$j/src" && seq -f 'file%g.c' "$FILES" |
+        xargs -n 100 sh -c 'for f; do echo "int $f;" | tr . _ > "$f"; done' sh)
+done
+
+printf '%-8s %-9s %8s %9s %8s\n' threads queues seconds requests workers
+t=1
+while :; do
+    for queues in clone single; do
+        if [ $queues = single ] && [ $t -ne "$MAX_THREADS" ]; then
+            continue
+        fi
+        opts="max_threads=$t,max_idle_threads=$t"
+        if [ $queues = single ]; then
+            opts="$opts,noclone_fd"
+        fi
+        bench_drop_caches
+        bench_mount "$opts"
+        s=$(bench_time readers)
+        bench_umount
+        printf '%-8s %-9s %8s %9s %8s\n' $t $queues "$s" \
+            "$(bench_requests)" "$(bench_stat workers_started)"
+    done
+    [ $t -ge "$MAX_THREADS" ] && break
+    t=$((t * 2))
+    [ $t -gt "$MAX_THREADS" ] && t=$MAX_THREADS
+done
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Write a file of SIZE_MB (64 by default) in BS (4096) byte writes, as logs
+# and small-record programs do, with and without writeback_cache, and count
+# how many write requests reached upfs and how many requests in all.
+. "$(dirname "$0")/lib.sh"
+SIZE_MB=${SIZE_MB:-64}
+BS=${BS:-4096}
+COUNT=$((SIZE_MB * 1024 * 1024 / BS))
+
+printf '%-16s %8s %9s %10s %9s\n' mode seconds writes "write KiB" requests
+for mode in default writeback_cache; do
+    opts=
+    if [ $mode = writeback_cache ]; then
+        opts=writeback_cache
+    fi
+
+    bench_setup
+    bench_mount "$opts"
+    t=$(bench_time dd if=/dev/zero of="$MNT/small" bs="$BS" count=$COUNT \
+        conv=fsync status=none)
+    bench_umount
+
+    writes=$(bench_stat write)
+    printf '%-16s %8s %9s %10s %9s\n' $mode "$t" "$writes" \
+        "$(awk -v b="$(bench_stat write_bytes)" -v n="$writes" \
+            'BEGIN { printf "%.0f", n ? b / n / 1024 : 0 }')" \
+        "$(bench_requests)"
+done
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Write a file of SIZE_MB (1024 by default) through upfs and read it back,
+# with and without splicing, and report the throughput and the CPU time upfs
+# itself used. Put the store on the media being measured with STORE_DIR.
+. "$(dirname "$0")/lib.sh"
+SIZE_MB=${SIZE_MB:-1024}
+
+rate() {
+    awk -v mb="$SIZE_MB" -v t="$1" 'BEGIN { printf "%.0f", mb / t }'
+}
+
+printf '%-9s %12s %10s %12s %10s\n' mode "write MiB/s" "write cpu" \
+    "read MiB/s" "read cpu"
+for mode in nosplice splice; do
+    opts=
+    if [ $mode = nosplice ]; then
+        opts=nosplice
+    fi
+
+    bench_setup
+    bench_mount "$opts"
+    w=$(bench_time dd if=/dev/zero of="$MNT/big" bs=1M count="$SIZE_MB" \
+        conv=fsync status=none)
+    bench_umount
+    w_cpu=$BENCH_CPU
+
+    bench_drop_caches
+    bench_mount "$opts"
+    r=$(bench_time dd if="$MNT/big" of=/dev/null bs=1M status=none)
+    bench_umount
+    r_cpu=$BENCH_CPU
+
+    printf '%-9s %12s %10s %12s %10s\n' $mode "$(rate "$w")" "$w_cpu" \
+        "$(rate "$r")" "$r_cpu"
+done
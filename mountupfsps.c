@@ -15,7 +15,7 @@
 #define UPFS_PATH "/usr/bin/upfs-ps"
 #endif
 
-#define NEED_OPTS "nonempty,allow_other,default_permissions"
+#define NEED_OPTS "allow_other,default_permissions"
 
 void usage(void)
 {
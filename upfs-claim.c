@@ -0,0 +1,646 @@
+/*
+ * upfs-claim: Claim every file in an existing store at once, before it's
+ * first mounted, rather than leaving upfs to claim each one on first write.
+ *
+ * Without UPFS_PS, this builds the permissions directory's mirror of the
+ * store. With UPFS_PS, it gives each store directory a complete .upfs table,
+ * written in one go. Either way, every file and directory claimed gets the
+ * same owner and mode, and what's already claimed is left alone, so an
+ * interrupted run is resumed by running it again.
+ */
+
+#define _GNU_SOURCE /* renameat2 */
+
+#ifdef UPFS_PS
+#define FUSE_USE_VERSION 312
+#include <fuse_lowlevel.h>
+#endif
+
+#include "upfs-names.h"
+#ifdef UPFS_PS
+#include "upfs-ps.h"
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef UPFS_PS
+#define CLAIM_NAME "upfs-ps-claim"
+#else
+#define CLAIM_NAME "upfs-claim"
+#endif
+
+/* Whom, and with what modes, to claim things for */
+static uid_t claim_uid;
+static gid_t claim_gid;
+static mode_t file_mode = 0644, dir_mode = 0755;
+
+#ifndef UPFS_PS
+static int perm_root = -1;
+#endif
+static int store_root = -1;
+
+/* A directory to claim, as its path in the store and in the permissions
+ * directory, both relative to their roots */
+struct job {
+    struct job *next, *prev;
+    char *store_path, *perm_path;
+};
+
+/* Each worker has its own deque of directories. It takes the newest of its
+ * own, so it goes depth first and keeps the queue short, and when it has
+ * none, steals the oldest of another's, which is likely the biggest subtree
+ * left. */
+struct worker {
+    pthread_t th;
+    int num;
+    pthread_mutex_t lock;
+    struct job *head, *tail;
+};
+
+static struct worker *workers;
+static int worker_count;
+
+/* How many jobs are queued, and how many are queued or running, and so how
+ * idle workers know whether to wait or finish. done_cond is for the main
+ * thread, waiting for them all. */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static size_t queued, pending;
+
+/* Progress, as how many were claimed, were already claimed, and failed */
+static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t claimed_count, already_count, failures;
+
+#ifdef UPFS_PS
+/* upfs-ps.c asks who's creating a file, so answer with whom we're claiming
+ * for */
+const struct fuse_ctx *upfs_get_context(void)
+{
+    static struct fuse_ctx ctx;
+    ctx.uid = claim_uid;
+    ctx.gid = claim_gid;
+    return &ctx;
+}
+#endif
+
+static void usage(void)
+{
+    fprintf(stderr,
+#ifdef UPFS_PS
+        "Use: " CLAIM_NAME " [options] <store root>\n"
+#else
+        "Use: " CLAIM_NAME " [options] <perm root> <store root>\n"
+#endif
+        "Options:\n"
+        "    -u uid      Owner to claim for (default: 0)\n"
+        "    -g gid      Group to claim for (default: 0)\n"
+        "    -f mode     Mode of claimed files (default: 0644)\n"
+        "    -d mode     Mode of claimed directories (default: 0755)\n"
+        "    -j threads  Threads to claim with (default: one per CPU)\n"
+        "    -q          Don't report progress\n");
+}
+
+static void fail(const char *path, const char *name)
+{
+    int save_errno = errno;
+    fprintf(stderr, CLAIM_NAME ": %s%s%s: %s\n", path, name ? "/" : "",
+        name ? name : "", strerror(save_errno));
+    pthread_mutex_lock(&count_lock);
+    failures++;
+    pthread_mutex_unlock(&count_lock);
+}
+
+/* Join a directory's path and a name in it */
+static char *join(const char *dir, const char *name)
+{
+    size_t dlen, nlen;
+    char *ret;
+
+    if (!strcmp(dir, "."))
+        return strdup(name);
+    dlen = strlen(dir);
+    nlen = strlen(name);
+    ret = malloc(dlen + nlen + 2);
+    if (!ret)
+        return NULL;
+    memcpy(ret, dir, dlen);
+    ret[dlen] = '/';
+    memcpy(ret + dlen + 1, name, nlen + 1);
+    return ret;
+}
+
+static struct job *job_new(const char *store_path, const char *perm_path)
+{
+    struct job *job = calloc(1, sizeof(struct job));
+    if (!job)
+        return NULL;
+    job->store_path = strdup(store_path);
+    job->perm_path = strdup(perm_path);
+    if (!job->store_path || !job->perm_path) {
+        free(job->store_path);
+        free(job->perm_path);
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+
+static void job_free(struct job *job)
+{
+    free(job->store_path);
+    free(job->perm_path);
+    free(job);
+}
+
+/* Queue a directory on this worker's deque */
+static void job_push(struct worker *w, struct job *job)
+{
+    pthread_mutex_lock(&w->lock);
+    job->prev = NULL;
+    job->next = w->head;
+    if (w->head)
+        w->head->prev = job;
+    else
+        w->tail = job;
+    w->head = job;
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&idle_lock);
+    queued++;
+    pending++;
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+/* Take a job from the head (our own) or tail (someone else's) of a deque */
+static struct job *job_take(struct worker *w, int own)
+{
+    struct job *job;
+
+    pthread_mutex_lock(&w->lock);
+    job = own ? w->head : w->tail;
+    if (job) {
+        if (own) {
+            w->head = job->next;
+            if (w->head)
+                w->head->prev = NULL;
+            else
+                w->tail = NULL;
+        } else {
+            w->tail = job->prev;
+            if (w->tail)
+                w->tail->next = NULL;
+            else
+                w->head = NULL;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if (job) {
+        pthread_mutex_lock(&idle_lock);
+        queued--;
+        pthread_mutex_unlock(&idle_lock);
+    }
+    return job;
+}
+
+/* Get the next job for this worker, or NULL when there are no more */
+static struct job *job_next(struct worker *w)
+{
+    struct job *job;
+    int i;
+
+    while (1) {
+        job = job_take(w, 1);
+        if (job)
+            return job;
+        for (i = 1; i < worker_count; i++) {
+            job = job_take(&workers[(w->num + i) % worker_count], 0);
+            if (job)
+                return job;
+        }
+
+        /* Nothing to steal, so wait for more, or for everything to finish */
+        pthread_mutex_lock(&idle_lock);
+        if (!pending) {
+            pthread_mutex_unlock(&idle_lock);
+            return NULL;
+        }
+        if (!queued)
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+static void job_done(void)
+{
+    pthread_mutex_lock(&idle_lock);
+    if (--pending == 0) {
+        pthread_cond_broadcast(&idle_cond);
+        pthread_cond_signal(&done_cond);
+    }
+    pthread_mutex_unlock(&idle_lock);
+}
+
+#ifndef UPFS_PS
+/* Claim one name in a permissions directory, as a file or directory. Unless
+ * we're claiming for ourselves, it's made under a temporary name, given away,
+ * then moved into place, so that an interrupted run never leaves a claim with
+ * the wrong owner. Returns 1 if claimed, 0 if it already was, or -1. */
+static int claim_perm(int perm_fd, const char *name, const char *tmp_name,
+    mode_t mode)
+{
+    const char *make_name = name;
+    int ret, tries = 0, save_errno;
+
+    if (claim_uid != geteuid() || claim_gid != getegid())
+        make_name = tmp_name;
+
+    while (1) {
+        if (S_ISDIR(mode))
+            ret = mkdirat(perm_fd, make_name, mode & 07777);
+        else
+            ret = mknodat(perm_fd, make_name, mode, 0);
+        if (ret == 0)
+            break;
+        if (errno != EEXIST)
+            return -1;
+        if (make_name == name)
+            return 0;
+
+        /* Left over from an interrupted run */
+        if (tries++ ||
+            (unlinkat(perm_fd, tmp_name, 0) < 0 &&
+             unlinkat(perm_fd, tmp_name, AT_REMOVEDIR) < 0))
+            return -1;
+    }
+    if (make_name == name)
+        return 1;
+
+    if (fchownat(perm_fd, tmp_name, claim_uid, claim_gid,
+            AT_SYMLINK_NOFOLLOW) < 0)
+        goto error;
+    if (renameat2(perm_fd, tmp_name, perm_fd, name, RENAME_NOREPLACE) < 0) {
+        if (errno != EEXIST)
+            goto error;
+        unlinkat(perm_fd, tmp_name, S_ISDIR(mode) ? AT_REMOVEDIR : 0);
+        return 0;
+    }
+    return 1;
+
+error:
+    save_errno = errno;
+    unlinkat(perm_fd, tmp_name, S_ISDIR(mode) ? AT_REMOVEDIR : 0);
+    errno = save_errno;
+    return -1;
+}
+#endif
+
+/* Claim everything in one directory, and queue its subdirectories */
+static void claim_dir(struct worker *w, struct job *job)
+{
+    char name[NAME_MAX+1], perm_name[PATH_MAX];
+    char *store_sub, *perm_sub;
+    struct job *sub;
+    struct dirent *d;
+    struct stat sbuf;
+    DIR *dh = NULL;
+    int store_fd, is_dir;
+    size_t claimed = 0, already = 0;
+#ifdef UPFS_PS
+    struct upfs_entry *claims = NULL, *ce;
+    size_t claim_count = 0, claim_size = 0;
+    struct timespec now;
+    int added;
+#else
+    char tmp_name[32];
+    int perm_fd = -1, ret;
+#endif
+
+    store_fd = openat(store_root, job->store_path, O_RDONLY|O_DIRECTORY);
+    if (store_fd < 0) {
+        fail(job->store_path, NULL);
+        return;
+    }
+#ifndef UPFS_PS
+    perm_fd = openat(perm_root, job->perm_path, O_RDONLY|O_DIRECTORY);
+    if (perm_fd < 0) {
+        fail(job->perm_path, NULL);
+        close(store_fd);
+        return;
+    }
+    snprintf(tmp_name, sizeof(tmp_name), ".upfs-claim.%d", w->num);
+#else
+    clock_gettime(CLOCK_REALTIME, &now);
+#endif
+
+    /* Read it through a descriptor of its own, since closedir closes it */
+    dh = fdopendir(dup(store_fd));
+    if (!dh) {
+        fail(job->store_path, NULL);
+        goto done;
+    }
+
+    while ((d = readdir(dh))) {
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+#ifdef UPFS_PS
+        if (!strcmp(d->d_name, UPFS_META_FILE) ||
+            !strcmp(d->d_name, UPFS_META_TEMP))
+            continue;
+#endif
+
+        /* We only claim files and directories, like upfs itself */
+        if (d->d_type == DT_UNKNOWN) {
+            if (fstatat(store_fd, d->d_name, &sbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+                fail(job->store_path, d->d_name);
+                continue;
+            }
+            if (!S_ISDIR(sbuf.st_mode) && !S_ISREG(sbuf.st_mode))
+                continue;
+            is_dir = S_ISDIR(sbuf.st_mode);
+        } else if (d->d_type == DT_DIR || d->d_type == DT_REG) {
+            is_dir = (d->d_type == DT_DIR);
+        } else {
+            continue;
+        }
+
+        upfs_path_from_store(name, d->d_name);
+        upfs_perm_path(perm_name, name);
+
+#ifdef UPFS_PS
+        /* The index can't hold names this long */
+        if (strlen(perm_name) >= UPFS_NAME_LENGTH) {
+            errno = ENAMETOOLONG;
+            fail(job->store_path, d->d_name);
+            continue;
+        }
+        if (claim_count == claim_size) {
+            claim_size = claim_size ? claim_size * 2 : 64;
+            ce = realloc(claims, claim_size * sizeof(struct upfs_entry));
+            if (!ce) {
+                fail(job->store_path, NULL);
+                goto done;
+            }
+            claims = ce;
+        }
+        ce = &claims[claim_count++];
+        memset(ce, 0, sizeof(struct upfs_entry));
+        ce->uid = claim_uid;
+        ce->gid = claim_gid;
+        ce->mode = is_dir ? (S_IFDIR|dir_mode) : (S_IFREG|file_mode);
+        ce->mtime.sec = ce->ctime.sec = now.tv_sec;
+        ce->mtime.nsec = ce->ctime.nsec = now.tv_nsec;
+        strcpy(ce->name, perm_name);
+
+#else
+        ret = claim_perm(perm_fd, perm_name, tmp_name,
+            is_dir ? (S_IFDIR|dir_mode) : (S_IFREG|file_mode));
+        if (ret < 0) {
+            fail(job->perm_path, perm_name);
+            continue;
+        } else if (ret == 0) {
+            already++;
+        } else {
+            claimed++;
+        }
+
+#endif
+
+        if (!is_dir)
+            continue;
+
+        /* And then everything in it */
+        store_sub = join(job->store_path, d->d_name);
+        perm_sub = join(job->perm_path, perm_name);
+        sub = (store_sub && perm_sub) ? job_new(store_sub, perm_sub) : NULL;
+        free(store_sub);
+        free(perm_sub);
+        if (!sub) {
+            fail(job->store_path, d->d_name);
+            continue;
+        }
+        job_push(w, sub);
+    }
+
+#ifdef UPFS_PS
+    /* Then the whole directory's table in one write */
+    if (claim_count) {
+        added = upfs_table_claim(store_fd, claims, claim_count);
+        if (added < 0) {
+            fail(job->store_path, UPFS_META_FILE);
+        } else {
+            claimed = added;
+            already = claim_count - added;
+        }
+    }
+#endif
+
+done:
+    pthread_mutex_lock(&count_lock);
+    claimed_count += claimed;
+    already_count += already;
+    pthread_mutex_unlock(&count_lock);
+
+    if (dh)
+        closedir(dh);
+    close(store_fd);
+#ifdef UPFS_PS
+    free(claims);
+#else
+    close(perm_fd);
+#endif
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct job *job;
+
+    while ((job = job_next(w))) {
+        claim_dir(w, job);
+        job_free(job);
+        job_done();
+    }
+    return NULL;
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) +
+        (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Say how far we've got, and how fast */
+static void report(const struct timespec *start, const char *end)
+{
+    double secs = elapsed(start);
+    size_t claimed, already, failed;
+
+    pthread_mutex_lock(&count_lock);
+    claimed = claimed_count;
+    already = already_count;
+    failed = failures;
+    pthread_mutex_unlock(&count_lock);
+
+    fprintf(stderr, "\r%zu claimed, %zu already claimed, %zu failed; "
+        "%.0f files/s%s", claimed, already, failed,
+        secs > 0 ? (claimed + already) / secs : 0.0, end);
+}
+
+static int parse_mode(const char *arg, mode_t *mode)
+{
+    char *end;
+    unsigned long val = strtoul(arg, &end, 8);
+    if (!*arg || *end || val > 07777)
+        return -1;
+    *mode = val;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct timespec start, until;
+    struct job *job;
+    long cpus;
+    int opt, i, quiet = 0;
+
+    while ((opt = getopt(argc, argv, "u:g:f:d:j:qh")) != -1) {
+        switch (opt) {
+            case 'u':
+                claim_uid = atol(optarg);
+                break;
+
+            case 'g':
+                claim_gid = atol(optarg);
+                break;
+
+            case 'f':
+                if (parse_mode(optarg, &file_mode) < 0) {
+                    usage();
+                    return 1;
+                }
+                break;
+
+            case 'd':
+                if (parse_mode(optarg, &dir_mode) < 0) {
+                    usage();
+                    return 1;
+                }
+                break;
+
+            case 'j':
+                worker_count = atoi(optarg);
+                if (worker_count < 1) {
+                    usage();
+                    return 1;
+                }
+                break;
+
+            case 'q':
+                quiet = 1;
+                break;
+
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+#ifdef UPFS_PS
+    if (argc - optind != 1) {
+        usage();
+        return 1;
+    }
+    store_root = open(argv[optind], O_RDONLY|O_DIRECTORY);
+    if (store_root < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+#else
+    if (argc - optind != 2) {
+        usage();
+        return 1;
+    }
+    perm_root = open(argv[optind], O_RDONLY|O_DIRECTORY);
+    if (perm_root < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    store_root = open(argv[optind+1], O_RDONLY|O_DIRECTORY);
+    if (store_root < 0) {
+        perror(argv[optind+1]);
+        return 1;
+    }
+#endif
+
+    /* Claims get exactly the modes asked for */
+    umask(0);
+
+    if (!worker_count) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = (cpus > 0) ? cpus : 1;
+    }
+    workers = calloc(worker_count, sizeof(struct worker));
+    if (!workers) {
+        perror("calloc");
+        return 1;
+    }
+    for (i = 0; i < worker_count; i++) {
+        workers[i].num = i;
+        pthread_mutex_init(&workers[i].lock, NULL);
+    }
+
+    /* Start from the root */
+    job = job_new(".", ".");
+    if (!job) {
+        perror("malloc");
+        return 1;
+    }
+    job_push(&workers[0], job);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < worker_count; i++) {
+        if (pthread_create(&workers[i].th, NULL, worker_thread,
+                &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    /* Report each second as we go, until they're all done */
+    pthread_mutex_lock(&idle_lock);
+    clock_gettime(CLOCK_REALTIME, &until);
+    while (pending) {
+        until.tv_sec++;
+        while (pending && pthread_cond_timedwait(&done_cond, &idle_lock,
+                    &until) != ETIMEDOUT);
+        if (pending && !quiet) {
+            pthread_mutex_unlock(&idle_lock);
+            report(&start, "");
+            pthread_mutex_lock(&idle_lock);
+        }
+    }
+    pthread_mutex_unlock(&idle_lock);
+
+    for (i = 0; i < worker_count; i++)
+        pthread_join(workers[i].th, NULL);
+    if (!quiet)
+        report(&start, "\n");
+
+    return failures ? 1 : 0;
+}
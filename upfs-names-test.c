@@ -0,0 +1,295 @@
+/* Check the name conversions in upfs-names.c against the character by
+ * character ones they replaced, and time both. Build it with the same
+ * UPFS_FATNAMES, UPFS_FATLOWERCASE and UPFS_PERMLOWERCASE as upfs;
+ * "make names-test" does so for every combination. */
+
+#define _XOPEN_SOURCE 700 /* clock_gettime */
+
+#include "upfs-names.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/****************************************************************
+ * THE OLD CONVERSIONS
+ ***************************************************************/
+
+#ifdef UPFS_FATNAMES
+static void old_store_path(char *store, const char *path)
+{
+    int o, i;
+    for (o = i = 0; path[i] && i < PATH_MAX - 1 && o < PATH_MAX - 1; i++) {
+        char c = path[i];
+        switch (c) {
+            case '"': case '?': case ':': case '*': case '|': case '<':
+            case '>':
+            case '$':
+            case '\\':
+                if (o + 4 >= PATH_MAX - 1)
+                    break;
+                store[o++] = '$';
+                snprintf(store+o, 3, "%02x", (int) (unsigned char) c);
+                o += 2;
+                break;
+
+            default:
+#ifdef UPFS_FATLOWERCASE
+                if (c >= 'A' && c <= 'Z') {
+                    if (o + 4 >= PATH_MAX - 1)
+                        break;
+                    store[o++] = '$';
+                    snprintf(store+o, 3, "%02x", (int) (unsigned char) c);
+                    o += 2;
+                } else
+#endif
+                store[o++] = c;
+                break;
+        }
+    }
+    store[o] = 0;
+}
+
+/* This was inline in readdir. It decoded a $ without two hex digits after it
+ * as garbage, so is only compared on names that store_path made. */
+static void old_path_from_store(char *path, const char *store)
+{
+    int o, i;
+    for (o = i = 0; store[i] && o < NAME_MAX - 1; i++) {
+        char c = store[i];
+        if (c == '$' && store[i+1] && store[i+2]) {
+            char h[3];
+            h[0] = store[i+1];
+            h[1] = store[i+2];
+            h[2] = 0;
+            c = strtol(h, NULL, 16);
+            i += 2;
+        }
+        path[o++] = c;
+    }
+    path[o] = 0;
+}
+
+#else
+static void old_store_path(char *store, const char *path)
+{
+    strncpy(store, path, PATH_MAX - 1);
+    store[PATH_MAX-1] = 0;
+}
+
+static void old_path_from_store(char *path, const char *store)
+{
+    strncpy(path, store, NAME_MAX - 1);
+    path[NAME_MAX-1] = 0;
+}
+
+#endif
+
+#ifdef UPFS_PERMLOWERCASE
+static void old_perm_path(char *perm, const char *path)
+{
+    int i;
+    for (i = 0; path[i] && i < PATH_MAX - 1; i++) {
+        char c = path[i];
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        perm[i] = c;
+    }
+    perm[i] = 0;
+}
+
+#else
+static void old_perm_path(char *perm, const char *path)
+{
+    strncpy(perm, path, PATH_MAX - 1);
+    perm[PATH_MAX-1] = 0;
+}
+
+#endif
+
+/****************************************************************
+ * ROUND TRIPS
+ ***************************************************************/
+
+static unsigned long checked = 0, failures = 0;
+
+/* Names are checked at every alignment, as the fast paths depend on it */
+static char aligned_buf[PATH_MAX + 32] __attribute__((aligned(16)));
+
+static void report(const char *what, const char *name, const char *got,
+    const char *want)
+{
+    if (failures++ < 10)
+        fprintf(stderr, "%s(\"%s\"): \"%s\", expected \"%s\"\n", what, name,
+            got, want);
+}
+
+static void check_at(const char *name, size_t align)
+{
+    static char store[PATH_MAX], old_store[PATH_MAX];
+    static char perm[PATH_MAX], old_perm[PATH_MAX];
+    static char back[NAME_MAX], old_back[NAME_MAX];
+    char *in = aligned_buf + align;
+    size_t len = strlen(name);
+
+    memcpy(in, name, len + 1);
+    checked++;
+
+    upfs_store_path(store, in);
+    old_store_path(old_store, in);
+    if (strcmp(store, old_store))
+        report("store_path", name, store, old_store);
+
+    upfs_perm_path(perm, in);
+    old_perm_path(old_perm, in);
+    if (strcmp(perm, old_perm))
+        report("perm_path", name, perm, old_perm);
+
+    /* Whatever fits in a name comes back as it was */
+    if (strlen(store) >= NAME_MAX - 1)
+        return;
+    memcpy(in, store, strlen(store) + 1);
+    upfs_path_from_store(back, in);
+    old_path_from_store(old_back, in);
+    if (strcmp(back, old_back))
+        report("path_from_store", store, back, old_back);
+    if (strcmp(back, name))
+        report("round trip", name, back, name);
+}
+
+static void check(const char *name)
+{
+    size_t align;
+    for (align = 0; align < 16; align++)
+        check_at(name, align);
+}
+
+/* A small, repeatable generator, so failures can be reproduced */
+static unsigned long long rand_state = 1;
+static unsigned int next_rand(void)
+{
+    rand_state = rand_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return rand_state >> 33;
+}
+
+static int run_checks(unsigned long random_names)
+{
+    char name[PATH_MAX];
+    unsigned long n;
+    int a, b;
+    size_t len, i;
+
+    /* Every name of one and two bytes */
+    for (a = 1; a < 256; a++) {
+        name[0] = a;
+        name[1] = 0;
+        check(name);
+        for (b = 1; b < 256; b++) {
+            name[1] = b;
+            name[2] = 0;
+            check(name);
+        }
+    }
+
+    /* Names right up to the limits, with and without escapes at the end */
+    for (len = NAME_MAX - 8; len < PATH_MAX; len++) {
+        memset(name, 'a', len);
+        name[len] = 0;
+        check(name);
+        name[len - 1] = ':';
+        check(name);
+        name[len / 2] = 'Q';
+        check(name);
+        if (len == NAME_MAX + 8)
+            len = PATH_MAX - 16;
+    }
+
+    /* And random ones, mostly plain with the odd special character, as
+     * real names are */
+    for (n = 0; n < random_names; n++) {
+        len = 1 + next_rand() % (NAME_MAX - 1);
+        for (i = 0; i < len; i++) {
+            if (next_rand() % 8)
+                name[i] = " -._0aZz"[next_rand() % 8] + next_rand() % 10;
+            else
+                name[i] = 1 + next_rand() % 255;
+        }
+        name[len] = 0;
+        check(name);
+    }
+
+    printf("%lu names checked, %lu failures\n", checked, failures);
+    return failures ? 1 : 0;
+}
+
+/****************************************************************
+ * TIMING
+ ***************************************************************/
+
+#define BENCH_NAMES 20000
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Time a conversion over every name, as many times as it takes to be
+ * measurable, in nanoseconds per name */
+#define TIME(fn, out, names) ({ \
+    double start_ = now(), t_; \
+    unsigned long rounds_ = 0; \
+    size_t i_; \
+    do { \
+        for (i_ = 0; i_ < BENCH_NAMES; i_++) \
+            fn(out, names[i_]); \
+        rounds_++; \
+    } while ((t_ = now() - start_) < 0.5); \
+    t_ * 1e9 / (rounds_ * BENCH_NAMES); \
+})
+
+static int run_bench(void)
+{
+    static char names[BENCH_NAMES][64], stored[BENCH_NAMES][96];
+    static const char *exts[] = { "JPG", "jpg", "CR2", "mp4", "HEIC" };
+    char *name_ptrs[BENCH_NAMES], *stored_ptrs[BENCH_NAMES];
+    char out[PATH_MAX];
+    size_t i;
+
+    /* Names like a directory of photos, some of them from a camera which
+     * puts times in them */
+    for (i = 0; i < BENCH_NAMES; i++) {
+        if (i % 10 == 0)
+            snprintf(names[i], sizeof(names[i]), "Photo %02zu:%02zu:%02zu.%s",
+                i / 3600 % 24, i / 60 % 60, i % 60, exts[i % 5]);
+        else
+            snprintf(names[i], sizeof(names[i]), "IMG_2019%04zu_%06zu.%s",
+                100 + i % 1200, i * 7919 % 1000000, exts[i % 5]);
+        upfs_store_path(out, names[i]);
+        memcpy(stored[i], out, strlen(out) + 1);
+        name_ptrs[i] = names[i];
+        stored_ptrs[i] = stored[i];
+    }
+
+    printf("%-16s %10s %10s\n", "ns per name", "old", "new");
+    printf("%-16s %10.1f %10.1f\n", "store_path",
+        TIME(old_store_path, out, name_ptrs),
+        TIME(upfs_store_path, out, name_ptrs));
+    printf("%-16s %10.1f %10.1f\n", "path_from_store",
+        TIME(old_path_from_store, out, stored_ptrs),
+        TIME(upfs_path_from_store, out, stored_ptrs));
+    printf("%-16s %10.1f %10.1f\n", "perm_path",
+        TIME(old_perm_path, out, name_ptrs),
+        TIME(upfs_perm_path, out, name_ptrs));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "-b"))
+        return run_bench();
+    return run_checks(argc > 1 ? strtoul(argv[1], NULL, 0) : 20000);
+}
@@ -0,0 +1,223 @@
+#include "upfs-names.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Bytes which end a run that can be copied as is: the terminator, and
+ * whatever needs converting */
+#ifdef UPFS_FATNAMES
+#ifndef __SSE2__
+static const unsigned char store_special[256] = {
+    [0] = 1,
+    ['"'] = 1, ['?'] = 1, [':'] = 1, ['*'] = 1, ['|'] = 1, ['<'] = 1,
+    ['>'] = 1, ['$'] = 1, ['\\'] = 1,
+#ifdef UPFS_FATLOWERCASE
+    ['A' ... 'Z'] = 1,
+#endif
+};
+
+static const unsigned char escape_special[256] = {
+    [0] = 1, ['$'] = 1
+};
+#endif
+
+static const char hex_digits[16] = "0123456789abcdef";
+
+/* Hex digits' values, plus one, so that 0 is not a digit */
+static const unsigned char hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+#endif
+
+#ifdef UPFS_PERMLOWERCASE
+/* What to add to each byte to fold its case */
+static const unsigned char perm_fold[256] = {
+    ['A' ... 'Z'] = 'a' - 'A'
+};
+#endif
+
+#ifdef __SSE2__
+/* Which of these 16 bytes end a run for the store */
+static inline __m128i store_stops(__m128i v)
+{
+    __m128i m = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+#ifdef UPFS_FATNAMES
+#define STOP(c) m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(c)))
+    STOP('"'); STOP('?'); STOP(':'); STOP('*'); STOP('|'); STOP('<');
+    STOP('>'); STOP('$'); STOP('\\');
+#undef STOP
+#ifdef UPFS_FATLOWERCASE
+    m = _mm_or_si128(m, _mm_and_si128(
+        _mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+        _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1))));
+#endif
+#endif
+    return m;
+}
+
+/* Which of these 16 bytes end a run from the store */
+static inline __m128i escape_stops(__m128i v)
+{
+    return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+}
+
+/* Find the length of the run at s which needs no conversion, 16 bytes at a
+ * time. Loads are aligned, so never cross into a page the string isn't in. */
+#define SPAN(s, stops) ({ \
+    const char *s_ = (s); \
+    uintptr_t addr_ = (uintptr_t) s_; \
+    const __m128i *p_ = (const __m128i *) (addr_ & ~(uintptr_t) 15); \
+    unsigned int bits_ = _mm_movemask_epi8(stops(_mm_load_si128(p_))); \
+    bits_ = (bits_ >> (addr_ & 15)) << (addr_ & 15); \
+    while (!bits_) \
+        bits_ = _mm_movemask_epi8(stops(_mm_load_si128(++p_))); \
+    (size_t) ((const char *) p_ + __builtin_ctz(bits_) - s_); \
+})
+
+#else
+#define SPAN(s, table) ({ \
+    const unsigned char *p_ = (const unsigned char *) (s); \
+    while (!table[*p_]) \
+        p_++; \
+    (size_t) ((const char *) p_ - (s)); \
+})
+
+#endif
+
+#ifdef UPFS_FATNAMES
+void upfs_store_path(char *store, const char *path)
+{
+    size_t i = 0, o = 0, run;
+    unsigned char c;
+
+    while (1) {
+#ifdef __SSE2__
+        run = SPAN(path + i, store_stops);
+#else
+        run = SPAN(path + i, store_special);
+#endif
+        if (run > PATH_MAX - 1 - o)
+            run = PATH_MAX - 1 - o;
+        memcpy(store + o, path + i, run);
+        o += run;
+        i += run;
+
+        c = path[i];
+        if (!c || o >= PATH_MAX - 1)
+            break;
+
+        /* Escape it, if there's room, or drop it */
+        if (o + 4 < PATH_MAX - 1) {
+            store[o++] = '$';
+            store[o++] = hex_digits[c >> 4];
+            store[o++] = hex_digits[c & 0xF];
+        }
+        i++;
+    }
+    store[o] = 0;
+}
+
+void upfs_path_from_store(char *path, const char *store)
+{
+    size_t i = 0, o = 0, run;
+    unsigned char hi, lo;
+
+    while (1) {
+#ifdef __SSE2__
+        run = SPAN(store + i, escape_stops);
+#else
+        run = SPAN(store + i, escape_special);
+#endif
+        if (run > NAME_MAX - 1 - o)
+            run = NAME_MAX - 1 - o;
+        memcpy(path + o, store + i, run);
+        o += run;
+        i += run;
+
+        /* Each $ should start an escaped byte. With UPFS_FATLOWERCASE they
+         * come several at a time, too close together to be worth scanning
+         * between. */
+        while (store[i] == '$' && o < NAME_MAX - 1) {
+            hi = hex_values[(unsigned char) store[i+1]];
+            lo = hi ? hex_values[(unsigned char) store[i+2]] : 0;
+            if (hi && lo) {
+                path[o++] = ((hi - 1) << 4) | (lo - 1);
+                i += 3;
+            } else {
+                path[o++] = '$';
+                i++;
+            }
+        }
+
+        if (!store[i] || o >= NAME_MAX - 1)
+            break;
+    }
+    path[o] = 0;
+}
+
+#else
+void upfs_store_path(char *store, const char *path)
+{
+    strncpy(store, path, PATH_MAX - 1);
+    store[PATH_MAX-1] = 0;
+}
+
+void upfs_path_from_store(char *path, const char *store)
+{
+    strncpy(path, store, NAME_MAX - 1);
+    path[NAME_MAX-1] = 0;
+}
+
+#endif
+
+#ifdef UPFS_PERMLOWERCASE
+void upfs_perm_path(char *perm, const char *path)
+{
+    size_t i = 0;
+    unsigned char c;
+
+    while (1) {
+#ifdef __SSE2__
+        /* Fold 16 bytes at a time once aligned, until the terminator is among
+         * them */
+        if (!((uintptr_t) (path + i) & 15) && i + 16 <= PATH_MAX - 1) {
+            __m128i v = _mm_load_si128((const __m128i *) (path + i));
+            if (!_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()))) {
+                __m128i upper = _mm_and_si128(
+                    _mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                    _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+                v = _mm_add_epi8(v,
+                    _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+                _mm_storeu_si128((__m128i *) (perm + i), v);
+                i += 16;
+                continue;
+            }
+        }
+#endif
+
+        c = path[i];
+        if (!c || i >= PATH_MAX - 1)
+            break;
+        perm[i++] = c + perm_fold[c];
+    }
+    perm[i] = 0;
+}
+
+#else
+void upfs_perm_path(char *perm, const char *path)
+{
+    strncpy(perm, path, PATH_MAX - 1);
+    perm[PATH_MAX-1] = 0;
+}
+
+#endif
@@ -0,0 +1,19 @@
+/* Converting names between the kernel, the store and the permissions
+ * directory */
+
+#ifndef UPFS_NAMES_H
+#define UPFS_NAMES_H 1
+
+/* Convert a path for the store, escaping what FAT can't hold (with
+ * UPFS_FATNAMES) and upper case (with UPFS_FATLOWERCASE) as $xx. store must
+ * hold PATH_MAX bytes. */
+void upfs_store_path(char *store, const char *path);
+
+/* Convert a name read from the store back. path must hold NAME_MAX bytes. */
+void upfs_path_from_store(char *path, const char *store);
+
+/* Convert a path for the permissions directory, folding case with
+ * UPFS_PERMLOWERCASE. perm must hold PATH_MAX bytes. */
+void upfs_perm_path(char *perm, const char *path);
+
+#endif
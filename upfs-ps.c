@@ -1,15 +1,18 @@
 #define _XOPEN_SOURCE 700 /* *at */
 
-#define FUSE_USE_VERSION 28
-#include <fuse.h>
+#define FUSE_USE_VERSION 312
+#include <fuse_lowlevel.h>
 
 #include "upfs.h"
 #include "upfs-ps.h"
+#include "upfs-stats.h"
 
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,132 +29,1872 @@ struct upfs_open_out {
     struct upfs_entry de;
     int *tbl_fd;
     off_t tbl_off;
+
+    /* The table's header, which for version 1 is only the first part, and
+     * whether we made this entry */
+    struct upfs_header_v2 dh;
+    int created;
+
+    /* The table file and its count of changes as we found them, for the
+     * cache */
+    struct stat tbl_sb;
+    uint32_t tbl_changes;
+
+    /* The table's lock, while the caller has it */
+    struct table_lock *lock;
+    int exclusive;
+};
+
+/* FNV-1a of a name, which split_path has already folded */
+static uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* The check of a journal record, FNV-1a of the words after the check. A word
+ * at a time, as a table's whole journal is checked as it's read. */
+static uint32_t journal_check(const char *buf, size_t size)
+{
+    uint32_t hash = 2166136261u, word;
+    size_t i;
+    for (i = sizeof(uint32_t); i < size; i += sizeof(uint32_t)) {
+        memcpy(&word, buf + i, sizeof(uint32_t));
+        hash ^= word;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* pread and pwrite, with anything short being an I/O error */
+static int pread_all(int fd, void *buf, size_t count, off_t offset)
+{
+    ssize_t rd = pread(fd, buf, count, offset);
+    if (rd < 0)
+        return -1;
+    if ((size_t) rd != count) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t count, off_t offset)
+{
+    ssize_t wr = pwrite(fd, buf, count, offset);
+    if (wr < 0)
+        return -1;
+    if ((size_t) wr != count) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the rest of a version 2 header, given its start */
+static int read_header_v2(int tbl_fd, struct upfs_header_v2 *dh)
+{
+    if (pread_all(tbl_fd, dh, sizeof(struct upfs_header_v2), 0) < 0)
+        return -1;
+    if (!dh->bucket_count) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* A change to a version 2 table has been made in place, so count it */
+static int table_changed(int tbl_fd, struct upfs_header_v2 *dh)
+{
+    dh->changes++;
+    return pwrite_all(tbl_fd, &dh->changes, sizeof(uint32_t),
+        offsetof(struct upfs_header_v2, changes));
+}
+
+/****************************************************************
+ * JOURNAL
+ ***************************************************************/
+
+/* Whether changes to this table go in its journal */
+#define JOURNALING(dh) \
+    (upfs_journal_max && (dh)->h.version >= UPFS_VERSION_HASHED)
+
+size_t upfs_journal_max = 0;
+
+/* The size of the intact journal record at the start of buf, or 0 if there
+ * isn't one */
+static size_t journal_record(const char *buf, size_t len,
+    struct upfs_journal_record *jr)
+{
+    size_t size;
+
+    if (len < sizeof(struct upfs_journal_record))
+        return 0;
+    memcpy(jr, buf, sizeof(struct upfs_journal_record));
+    if (!jr->name_length || jr->name_length >= UPFS_NAME_LENGTH)
+        return 0;
+    size = (sizeof(struct upfs_journal_record) + jr->name_length + 7) &
+        ~(size_t) 7;
+    if (size > len || journal_check(buf, size) != jr->check)
+        return 0;
+    return size;
+}
+
+/* Append a change to a table's journal, setting name to de, or removing it if
+ * de is NULL. The first change starts the journal, making it version 3. Like
+ * changes made in place, it's only synced when a file in the directory is. */
+static int journal_append(int tbl_fd, struct upfs_header_v2 *dh,
+    const char *name, const struct upfs_entry *de)
+{
+    char buf[sizeof(struct upfs_journal_record) + UPFS_NAME_LENGTH + 8];
+    struct upfs_journal_record jr;
+    size_t len = strlen(name), size;
+    off_t end;
+
+    memset(&jr, 0, sizeof(struct upfs_journal_record));
+    if (de) {
+        jr.uid = de->uid;
+        jr.gid = de->gid;
+        jr.mode = de->mode;
+        jr.mtime = de->mtime;
+        jr.ctime = de->ctime;
+    } else {
+        jr.uid = (uint32_t) -1;
+    }
+    jr.name_length = len;
+    size = (sizeof(struct upfs_journal_record) + len + 7) & ~(size_t) 7;
+    memset(buf, 0, size);
+    memcpy(buf, &jr, sizeof(struct upfs_journal_record));
+    memcpy(buf + sizeof(struct upfs_journal_record), name, len);
+    jr.check = journal_check(buf, size);
+    memcpy(buf, &jr.check, sizeof(uint32_t));
+
+    end = lseek(tbl_fd, 0, SEEK_END);
+    if (end == (off_t) -1)
+        return -1;
+    if (!dh->journal) {
+        end = (end + 7) & ~(off_t) 7;
+        if (end > UINT32_MAX) {
+            errno = EFBIG;
+            return -1;
+        }
+        dh->h.version = UPFS_VERSION_JOURNAL;
+        dh->journal = end;
+        if (pwrite_all(tbl_fd, dh, sizeof(struct upfs_header_v2), 0) < 0)
+            return -1;
+    }
+    if (pwrite_all(tbl_fd, buf, size, end) < 0)
+        return -1;
+
+    UPFS_COUNT(journal_append);
+    return 0;
+}
+
+/* A table's journal, parsed by name, as far as end. Each table's lock keeps
+ * one for as long as its handle is on the same table file, and until the
+ * journal is folded in, which replaces the file, it only grows, so lookups
+ * only read what's been added since the last. */
+struct journal_entry {
+    struct journal_entry *next;
+    uint32_t hash, uid, gid;
+    uint16_t mode;
+    struct upfs_time mtime, ctime;
+    char name[];
+};
+
+struct journal_map {
+    pthread_mutex_t lock;
+    uint32_t start;
+    off_t end;
+    size_t count, bucket_count;
+    struct journal_entry **buckets;
+};
+
+/* Forget everything parsed, with the map's lock held if it's in use */
+static void journal_map_clear(struct journal_map *jm)
+{
+    struct journal_entry *je, *next;
+    size_t i;
+
+    for (i = 0; i < jm->bucket_count; i++) {
+        for (je = jm->buckets[i]; je; je = next) {
+            next = je->next;
+            free(je);
+        }
+    }
+    free(jm->buckets);
+    jm->buckets = NULL;
+    jm->count = jm->bucket_count = 0;
+    jm->start = 0;
+    jm->end = 0;
+}
+
+static struct journal_entry **journal_map_slot(struct journal_map *jm,
+    const char *name, uint32_t hash)
+{
+    struct journal_entry **jep = &jm->buckets[hash & (jm->bucket_count - 1)];
+    while (*jep && ((*jep)->hash != hash || strcmp((*jep)->name, name)))
+        jep = &(*jep)->next;
+    return jep;
+}
+
+/* Set a name's last change from its journal record */
+static int journal_map_set(struct journal_map *jm,
+    const struct upfs_journal_record *jr, const char *name)
+{
+    struct journal_entry *je, **jep, **buckets, *next;
+    uint32_t hash = name_hash(name);
+    size_t len = strlen(name), bucket_count, i;
+
+    /* Keep the chains short */
+    if (jm->count >= 2 * jm->bucket_count) {
+        bucket_count = jm->bucket_count ? 2 * jm->bucket_count : 64;
+        buckets = calloc(bucket_count, sizeof(struct journal_entry *));
+        if (!buckets)
+            return -1;
+        for (i = 0; i < jm->bucket_count; i++) {
+            for (je = jm->buckets[i]; je; je = next) {
+                next = je->next;
+                jep = &buckets[je->hash & (bucket_count - 1)];
+                je->next = *jep;
+                *jep = je;
+            }
+        }
+        free(jm->buckets);
+        jm->buckets = buckets;
+        jm->bucket_count = bucket_count;
+    }
+
+    jep = journal_map_slot(jm, name, hash);
+    je = *jep;
+    if (!je) {
+        je = malloc(sizeof(struct journal_entry) + len + 1);
+        if (!je)
+            return -1;
+        je->next = NULL;
+        je->hash = hash;
+        memcpy(je->name, name, len + 1);
+        *jep = je;
+        jm->count++;
+    }
+    je->uid = jr->uid;
+    je->gid = jr->gid;
+    je->mode = jr->mode;
+    je->mtime = jr->mtime;
+    je->ctime = jr->ctime;
+    return 0;
+}
+
+/* Bring the map up to date with the table's journal, with the map's lock
+ * held. If torn isn't NULL, it's set to where a torn record starts, or 0. */
+static int journal_map_read(struct journal_map *jm, int tbl_fd,
+    const struct upfs_header_v2 *dh, off_t *torn)
+{
+    struct upfs_journal_record jr;
+    struct stat sbuf;
+    char name[UPFS_NAME_LENGTH], *buf;
+    size_t size, pos = 0, rec;
+    int save_errno;
+
+    if (torn) *torn = 0;
+    if (jm->start != dh->journal) {
+        journal_map_clear(jm);
+        jm->start = dh->journal;
+        jm->end = dh->journal;
+    }
+    if (!dh->journal)
+        return 0;
+    if (fstat(tbl_fd, &sbuf) < 0)
+        return -1;
+    if (sbuf.st_size < jm->end) {
+        /* Only a torn record is ever cut off, and that we never parsed, but
+         * start again if not */
+        journal_map_clear(jm);
+        jm->start = jm->end = dh->journal;
+    }
+    if (sbuf.st_size <= jm->end)
+        return 0;
+
+    size = sbuf.st_size - jm->end;
+    buf = malloc(size);
+    if (!buf)
+        return -1;
+    if (pread_all(tbl_fd, buf, size, jm->end) < 0)
+        goto error;
+    for (pos = 0; pos < size; pos += rec) {
+        rec = journal_record(buf + pos, size - pos, &jr);
+        if (!rec) {
+            if (torn) *torn = jm->end + pos;
+            break;
+        }
+        memcpy(name, buf + pos + sizeof(struct upfs_journal_record),
+            jr.name_length);
+        name[jr.name_length] = 0;
+        if (journal_map_set(jm, &jr, name) < 0)
+            goto error;
+    }
+    jm->end += pos;
+    free(buf);
+    return 0;
+
+error:
+    save_errno = errno;
+    jm->end += pos;
+    free(buf);
+    errno = save_errno;
+    return -1;
+}
+
+/* Apply the journal in buf to a table's live entries, which are reallocated
+ * to make room for new ones */
+static int journal_apply(const char *buf, size_t size,
+    struct upfs_entry **entries_io, size_t *count_io)
+{
+    struct upfs_journal_record jr;
+    struct upfs_entry *entries, *de;
+    char name[UPFS_NAME_LENGTH];
+    size_t count = *count_io, records = 0, slots, pos, rec, i, j;
+    size_t *index;
+
+    for (pos = 0; pos < size &&
+        (rec = journal_record(buf + pos, size - pos, &jr)); pos += rec)
+        records++;
+    if (!records)
+        return 0;
+    entries = realloc(*entries_io,
+        (count + records + 1) * sizeof(struct upfs_entry));
+    if (!entries)
+        return -1;
+    *entries_io = entries;
+
+    /* Index the entries by name, each slot holding its index plus one */
+    for (slots = 16; slots < 2 * (count + records); slots *= 2);
+    index = calloc(slots, sizeof(size_t));
+    if (!index)
+        return -1;
+    for (i = 0; i < count; i++) {
+        for (j = name_hash(entries[i].name) & (slots - 1); index[j];
+            j = (j + 1) & (slots - 1));
+        index[j] = i + 1;
+    }
+
+    /* Removed names are kept until the end, in case they come back */
+    for (pos = 0; pos < size &&
+        (rec = journal_record(buf + pos, size - pos, &jr)); pos += rec) {
+        memset(name, 0, UPFS_NAME_LENGTH);
+        memcpy(name, buf + pos + sizeof(struct upfs_journal_record),
+            jr.name_length);
+        for (j = name_hash(name) & (slots - 1); index[j];
+            j = (j + 1) & (slots - 1)) {
+            if (!strcmp(entries[index[j] - 1].name, name))
+                break;
+        }
+        if (index[j]) {
+            de = &entries[index[j] - 1];
+        } else {
+            de = &entries[count];
+            memset(de, 0, sizeof(struct upfs_entry));
+            strcpy(de->name, name);
+            index[j] = ++count;
+        }
+        de->uid = jr.uid;
+        de->gid = jr.gid;
+        de->mode = jr.mode;
+        de->mtime = jr.mtime;
+        de->ctime = jr.ctime;
+    }
+
+    for (i = j = 0; i < count; i++) {
+        if (entries[i].uid != (uint32_t) -1)
+            entries[j++] = entries[i];
+    }
+    *count_io = j;
+    free(index);
+    return 0;
+}
+
+/* Write an entry's metadata, but not its name, back to the table */
+static int write_entry(int tbl_fd, struct upfs_header_v2 *dh, off_t off,
+    const struct upfs_entry *de)
+{
+    struct upfs_record r;
+
+    if (JOURNALING(dh))
+        return journal_append(tbl_fd, dh, de->name, de);
+    if (dh->h.version < 2)
+        return pwrite_all(tbl_fd, de, sizeof(struct upfs_entry), off);
+
+    if (pread_all(tbl_fd, &r, sizeof(struct upfs_record), off) < 0)
+        return -1;
+    r.uid = de->uid;
+    r.gid = de->gid;
+    r.mode = de->mode;
+    r.mtime = de->mtime;
+    r.ctime = de->ctime;
+    if (pwrite_all(tbl_fd, &r, sizeof(struct upfs_record), off) < 0)
+        return -1;
+    return table_changed(tbl_fd, dh);
+}
+
+/* Free (unlink) a directory entry. It stays in its chain, so this is just the
+ * one write. Version 1 tables are upgraded before anything is freed. */
+static int free_entry(int tbl_fd, struct upfs_header_v2 *dh, off_t off,
+    const char *name)
+{
+    uint32_t unused = (uint32_t) -1;
+
+    if (JOURNALING(dh))
+        return journal_append(tbl_fd, dh, name, NULL);
+    if (dh->h.version < 2) {
+        errno = EIO;
+        return -1;
+    }
+    if (pwrite_all(tbl_fd, &unused, sizeof(uint32_t),
+        off + offsetof(struct upfs_record, uid)) < 0)
+        return -1;
+    return table_changed(tbl_fd, dh);
+}
+
+/* Find a name in a version 2 table. Returns 1 if it's found, 0 if not, or -1
+ * on error. If reuse isn't NULL, it's set to an unused record in the same
+ * chain which the name would fit in, if there is one. */
+static int find_entry(int tbl_fd, const struct upfs_header_v2 *dh,
+    const char *name, uint32_t hash, struct upfs_entry *de, off_t *off,
+    off_t *reuse)
+{
+    struct upfs_record r;
+    char rname[UPFS_NAME_LENGTH];
+    size_t len = strlen(name);
+    uint32_t cur, steps = 0;
+
+    if (reuse) *reuse = 0;
+    if (pread_all(tbl_fd, &cur, sizeof(uint32_t),
+        dh->buckets + (off_t) (hash % dh->bucket_count) * sizeof(uint32_t)) < 0)
+        return -1;
+
+    for (; cur; cur = r.next) {
+        if (steps++ >= dh->records) {
+            /* More than the header counts, so the chain loops! */
+            errno = EIO;
+            return -1;
+        }
+        if (pread_all(tbl_fd, &r, sizeof(struct upfs_record), cur) < 0)
+            return -1;
+
+        if (r.uid == (uint32_t) -1) {
+            if (reuse && !*reuse && r.name_length >= len)
+                *reuse = cur;
+            continue;
+        }
+        if (r.hash != hash || r.name_length != len)
+            continue;
+        if (pread_all(tbl_fd, rname, len, r.name) < 0)
+            return -1;
+        if (memcmp(rname, name, len))
+            continue;
+
+        /* Found it! */
+        memset(de, 0, sizeof(struct upfs_entry));
+        de->uid = r.uid;
+        de->gid = r.gid;
+        de->mode = r.mode;
+        de->mtime = r.mtime;
+        de->ctime = r.ctime;
+        memcpy(de->name, name, len);
+        *off = cur;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Find a name in a version 2 or 3 table, as find_entry, but with the journal,
+ * as parsed into jm, having the last word. Entries from the journal are at
+ * offset 0. torn is as for journal_map_read. */
+static int lookup_entry(int tbl_fd, const struct upfs_header_v2 *dh,
+    struct journal_map *jm, const char *name, uint32_t hash,
+    struct upfs_entry *de, off_t *off, off_t *reuse, off_t *torn)
+{
+    struct journal_entry *je;
+    int found;
+
+    found = find_entry(tbl_fd, dh, name, hash, de, off, reuse);
+    if (found < 0)
+        return -1;
+
+    pthread_mutex_lock(&jm->lock);
+    if (journal_map_read(jm, tbl_fd, dh, torn) < 0) {
+        pthread_mutex_unlock(&jm->lock);
+        return -1;
+    }
+    je = jm->count ? *journal_map_slot(jm, name, hash) : NULL;
+    if (je) {
+        if (je->uid == (uint32_t) -1) {
+            found = 0;
+        } else {
+            memset(de, 0, sizeof(struct upfs_entry));
+            de->uid = je->uid;
+            de->gid = je->gid;
+            de->mode = je->mode;
+            de->mtime = je->mtime;
+            de->ctime = je->ctime;
+            strcpy(de->name, name);
+            *off = 0;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&jm->lock);
+    return found;
+}
+
+/* Allocate and initialize a directory entry in a version 2 table, either in
+ * the unused record reuse or at the end, or just journal it */
+static off_t alloc_entry(int tbl_fd, struct upfs_header_v2 *dh,
+    const struct upfs_entry *de, uint32_t hash, off_t reuse)
+{
+    struct upfs_record r;
+    size_t len = strlen(de->name);
+    off_t end, bucket, rec;
+    uint32_t rec32;
+
+    if (JOURNALING(dh))
+        return journal_append(tbl_fd, dh, de->name, de) < 0 ? -1 : 0;
+
+    memset(&r, 0, sizeof(struct upfs_record));
+    r.uid = de->uid;
+    r.gid = de->gid;
+    r.mode = de->mode;
+    r.mtime = de->mtime;
+    r.ctime = de->ctime;
+    r.name_length = len;
+    r.hash = hash;
+
+    if (reuse) {
+        /* Take over the old record and its name's space. The name goes first,
+         * so the record is never live with the wrong one. */
+        struct upfs_record old;
+        if (pread_all(tbl_fd, &old, sizeof(struct upfs_record), reuse) < 0)
+            return -1;
+        r.next = old.next;
+        r.name = old.name;
+        if (pwrite_all(tbl_fd, de->name, len, r.name) < 0)
+            return -1;
+        if (pwrite_all(tbl_fd, &r, sizeof(struct upfs_record), reuse) < 0)
+            return -1;
+        if (table_changed(tbl_fd, dh) < 0)
+            return -1;
+        return reuse;
+    }
+
+    /* Put the name and record at the end, count it, and only then link it
+     * in, so the header never counts fewer records than the chains hold */
+    end = lseek(tbl_fd, 0, SEEK_END);
+    if (end == (off_t) -1)
+        return -1;
+    rec = (end + len + 7) & ~(off_t) 7;
+    if (rec + sizeof(struct upfs_record) > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    bucket = dh->buckets + (off_t) (hash % dh->bucket_count) * sizeof(uint32_t);
+    if (pread_all(tbl_fd, &r.next, sizeof(uint32_t), bucket) < 0)
+        return -1;
+    r.name = end;
+    if (pwrite_all(tbl_fd, de->name, len, r.name) < 0)
+        return -1;
+    if (pwrite_all(tbl_fd, &r, sizeof(struct upfs_record), rec) < 0)
+        return -1;
+    dh->records++;
+    if (pwrite_all(tbl_fd, dh, sizeof(struct upfs_header_v2), 0) < 0)
+        return -1;
+    rec32 = rec;
+    if (pwrite_all(tbl_fd, &rec32, sizeof(uint32_t), bucket) < 0)
+        return -1;
+    if (table_changed(tbl_fd, dh) < 0)
+        return -1;
+
+    return rec;
+}
+
+/* Load every live entry of a table */
+static int table_entries(int tbl_fd, const struct upfs_header_v2 *dh,
+    struct upfs_entry **entries_out, size_t *count_out)
+{
+    struct stat sbuf;
+    struct upfs_entry *entries = NULL, *de;
+    struct upfs_record r;
+    char *buf = NULL;
+    size_t size, max, count = 0, i;
+    uint32_t cur, steps;
+    int save_errno;
+
+    if (fstat(tbl_fd, &sbuf) < 0)
+        return -1;
+    size = sbuf.st_size;
+    buf = malloc(size + 1);
+    if (!buf)
+        return -1;
+    if (pread_all(tbl_fd, buf, size, 0) < 0)
+        goto error;
+
+    if (dh->h.version < 2) {
+        max = (size - sizeof(struct upfs_header)) / sizeof(struct upfs_entry);
+        entries = malloc((max + 1) * sizeof(struct upfs_entry));
+        if (!entries)
+            goto error;
+        for (i = 0; i < max; i++) {
+            de = &entries[count];
+            memcpy(de, buf + sizeof(struct upfs_header) +
+                i * sizeof(struct upfs_entry), sizeof(struct upfs_entry));
+            de->name[UPFS_NAME_LENGTH-1] = 0;
+            if (de->uid != (uint32_t) -1)
+                count++;
+        }
+
+    } else {
+        if (dh->buckets + (size_t) dh->bucket_count * sizeof(uint32_t) > size) {
+            errno = EIO;
+            goto error;
+        }
+        max = dh->records;
+        entries = malloc((max + 1) * sizeof(struct upfs_entry));
+        if (!entries)
+            goto error;
+        steps = 0;
+        for (i = 0; i < dh->bucket_count; i++) {
+            memcpy(&cur, buf + dh->buckets + i * sizeof(uint32_t),
+                sizeof(uint32_t));
+            for (; cur; cur = r.next) {
+                if (steps++ >= max || cur + sizeof(struct upfs_record) > size) {
+                    errno = EIO;
+                    goto error;
+                }
+                memcpy(&r, buf + cur, sizeof(struct upfs_record));
+                if (r.uid == (uint32_t) -1)
+                    continue;
+                if (r.name_length >= UPFS_NAME_LENGTH ||
+                    (size_t) r.name + r.name_length > size) {
+                    errno = EIO;
+                    goto error;
+                }
+                de = &entries[count++];
+                memset(de, 0, sizeof(struct upfs_entry));
+                de->uid = r.uid;
+                de->gid = r.gid;
+                de->mode = r.mode;
+                de->mtime = r.mtime;
+                de->ctime = r.ctime;
+                memcpy(de->name, buf + r.name, r.name_length);
+            }
+        }
+
+        if (dh->journal && dh->journal < size &&
+            journal_apply(buf + dh->journal, size - dh->journal, &entries,
+            &count) < 0)
+            goto error;
+
+    }
+
+    free(buf);
+    *entries_out = entries;
+    *count_out = count;
+    return 0;
+
+error:
+    save_errno = errno;
+    free(buf);
+    free(entries);
+    errno = save_errno;
+    return -1;
+}
+
+/* Start a fresh, empty version 2 table */
+static int table_init(int tbl_fd, struct upfs_header_v2 *dh)
+{
+    char buf[sizeof(struct upfs_header_v2) +
+        UPFS_V2_MIN_BUCKETS * sizeof(uint32_t)] = {0};
+
+    memset(dh, 0, sizeof(struct upfs_header_v2));
+    memcpy(dh->h.magic, UPFS_MAGIC, UPFS_MAGIC_LENGTH);
+    dh->h.version = UPFS_VERSION_HASHED;
+    dh->h.free_list = (uint32_t) -1;
+    dh->buckets = sizeof(struct upfs_header_v2);
+    dh->bucket_count = UPFS_V2_MIN_BUCKETS;
+    memcpy(buf, dh, sizeof(struct upfs_header_v2));
+    return pwrite_all(tbl_fd, buf, sizeof(buf), 0);
+}
+
+/* Write a fresh version 2 table of these entries, in one write, and put it in
+ * place of the directory's table, which the caller has locked. Anyone waiting
+ * for the old table's lock notices it's been unlinked and starts again. */
+static int table_write(int dir_fd, const struct upfs_entry *entries,
+    size_t count)
+{
+    struct upfs_header_v2 ndh;
+    struct upfs_record r;
+    uint32_t *buckets, b;
+    size_t i, len, size, off;
+    char *buf = NULL;
+    int new_fd = -1;
+    int save_errno;
+
+    memset(&ndh, 0, sizeof(struct upfs_header_v2));
+    memcpy(ndh.h.magic, UPFS_MAGIC, UPFS_MAGIC_LENGTH);
+    ndh.h.version = UPFS_VERSION_HASHED;
+    ndh.h.free_list = (uint32_t) -1;
+    ndh.buckets = sizeof(struct upfs_header_v2);
+    ndh.bucket_count = UPFS_V2_MIN_BUCKETS;
+    while (ndh.bucket_count < count)
+        ndh.bucket_count *= 2;
+    ndh.records = count;
+
+    /* Lay it all out in memory: header, buckets, then each name and its
+     * record */
+    size = ndh.buckets + ndh.bucket_count * sizeof(uint32_t);
+    for (i = 0; i < count; i++) {
+        size += strlen(entries[i].name);
+        size = ((size + 7) & ~(size_t) 7) + sizeof(struct upfs_record);
+    }
+    if (size > UINT32_MAX) {
+        errno = EFBIG;
+        goto error;
+    }
+    buf = calloc(1, size);
+    if (!buf)
+        goto error;
+    memcpy(buf, &ndh, sizeof(struct upfs_header_v2));
+    buckets = (uint32_t *) (buf + ndh.buckets);
+
+    off = ndh.buckets + ndh.bucket_count * sizeof(uint32_t);
+    for (i = 0; i < count; i++) {
+        len = strlen(entries[i].name);
+        memset(&r, 0, sizeof(struct upfs_record));
+        r.uid = entries[i].uid;
+        r.gid = entries[i].gid;
+        r.mode = entries[i].mode;
+        r.mtime = entries[i].mtime;
+        r.ctime = entries[i].ctime;
+        r.name_length = len;
+        r.hash = name_hash(entries[i].name);
+        r.name = off;
+        memcpy(buf + off, entries[i].name, len);
+        off = (off + len + 7) & ~(size_t) 7;
+
+        b = r.hash % ndh.bucket_count;
+        r.next = buckets[b];
+        buckets[b] = off;
+        memcpy(buf + off, &r, sizeof(struct upfs_record));
+        off += sizeof(struct upfs_record);
+    }
+
+    /* Make sure it's all there before it replaces the old one */
+    new_fd = openat(dir_fd, UPFS_META_TEMP, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if (new_fd < 0)
+        goto error;
+    if (pwrite_all(new_fd, buf, size, 0) < 0)
+        goto error;
+    if (fsync(new_fd) < 0)
+        goto error;
+    if (renameat(dir_fd, UPFS_META_TEMP, dir_fd, UPFS_META_FILE) < 0)
+        goto error;
+    close(new_fd);
+    free(buf);
+
+    /* And that the rename is, too. The new name may be someone else's by now,
+     * so it isn't removed if this fails. */
+    if (fsync(dir_fd) < 0)
+        return -1;
+    return 0;
+
+error:
+    save_errno = errno;
+    if (new_fd >= 0) {
+        close(new_fd);
+        unlinkat(dir_fd, UPFS_META_TEMP, 0);
+    }
+    free(buf);
+    errno = save_errno;
+    return -1;
+}
+
+/* Write a fresh version 2 table with the live entries of the locked table
+ * tbl_fd, and put it in its place. This is how old tables are upgraded, how
+ * the hash table grows, and how journals are folded in. */
+static int table_rewrite(int dir_fd, int tbl_fd, const struct upfs_header_v2 *dh)
+{
+    struct upfs_entry *entries;
+    size_t count;
+    int ret;
+
+    if (table_entries(tbl_fd, dh, &entries, &count) < 0)
+        return -1;
+    ret = table_write(dir_fd, entries, count);
+    if (ret == 0 && dh->h.version >= 2 && dh->journal)
+        UPFS_COUNT(journal_checkpoint);
+    free(entries);
+    return ret;
+}
+
+/* Open a directory relative to another. upfs's directory handles are usually
+ * the directory itself, which needs no walk at all. */
+static int open_dir(int dir_fd, const char *path_dir)
+{
+    if (!strcmp(path_dir, "."))
+        return dup(dir_fd);
+    return openat(dir_fd, path_dir, O_RDONLY);
+}
+
+/****************************************************************
+ * TABLE LOCKS
+ ***************************************************************/
+
+/* Threads share one handle on each directory's table, and take turns with it
+ * through a reader/writer lock, so that flock only has to keep other processes
+ * out. The first reader in takes a shared flock for all of them, and the last
+ * out releases it; writers take an exclusive one for themselves. Recently
+ * used handles stay open, with their contention, which goes in the
+ * statistics. */
+struct table_lock {
+    struct table_lock *next, *lru_prev, *lru_next;
+    dev_t dev;
+    ino_t ino;
+    unsigned int users;
+    pthread_rwlock_t lock;
+
+    /* The handle, and how many readers are using it, protected by fd_lock */
+    pthread_mutex_t fd_lock;
+    int fd;
+    unsigned int readers;
+
+    /* The journal of the table the handle is on, as far as we've read it */
+    struct journal_map journal;
+
+    /* How often it was taken, how often and how long threads waited, and
+     * where it is, once anyone has */
+    uint64_t taken, waits, wait_ns;
+    char *path;
+};
+
+#define TABLE_LOCK_BUCKETS 256
+#define TABLE_LOCKS_IDLE 256
+
+/* Protected by table_locks_lock. Idle locks are in the LRU. */
+static pthread_mutex_t table_locks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct table_lock *table_locks[TABLE_LOCK_BUCKETS];
+static struct table_lock *table_locks_lru_head = NULL, *table_locks_lru_tail = NULL;
+static size_t table_locks_idle = 0;
+
+static struct table_lock **table_lock_slot(dev_t dev, ino_t ino)
+{
+    struct table_lock **tlp = &table_locks[
+        (size_t) (ino ^ dev) % TABLE_LOCK_BUCKETS];
+    while (*tlp && ((*tlp)->dev != dev || (*tlp)->ino != ino))
+        tlp = &(*tlp)->next;
+    return tlp;
+}
+
+static void table_lock_lru_remove(struct table_lock *tl)
+{
+    if (tl->lru_prev)
+        tl->lru_prev->lru_next = tl->lru_next;
+    else
+        table_locks_lru_head = tl->lru_next;
+    if (tl->lru_next)
+        tl->lru_next->lru_prev = tl->lru_prev;
+    else
+        table_locks_lru_tail = tl->lru_prev;
+    tl->lru_prev = tl->lru_next = NULL;
+    table_locks_idle--;
+}
+
+static void table_lock_free(struct table_lock *tl)
+{
+    *table_lock_slot(tl->dev, tl->ino) = tl->next;
+    pthread_rwlock_destroy(&tl->lock);
+    pthread_mutex_destroy(&tl->fd_lock);
+    if (tl->fd >= 0)
+        close(tl->fd);
+    journal_map_clear(&tl->journal);
+    pthread_mutex_destroy(&tl->journal.lock);
+    free(tl->path);
+    free(tl);
+}
+
+/* Get the lock for a directory's table */
+static struct table_lock *table_lock_get(int dir_fd)
+{
+    struct table_lock *tl, **tlp;
+    struct stat sbuf;
+
+    if (fstat(dir_fd, &sbuf) < 0)
+        return NULL;
+
+    pthread_mutex_lock(&table_locks_lock);
+    tlp = table_lock_slot(sbuf.st_dev, sbuf.st_ino);
+    tl = *tlp;
+    if (tl) {
+        if (!tl->users++)
+            table_lock_lru_remove(tl);
+        pthread_mutex_unlock(&table_locks_lock);
+        return tl;
+    }
+
+    tl = calloc(1, sizeof(struct table_lock));
+    if (!tl) {
+        pthread_mutex_unlock(&table_locks_lock);
+        return NULL;
+    }
+    tl->dev = sbuf.st_dev;
+    tl->ino = sbuf.st_ino;
+    tl->users = 1;
+    tl->fd = -1;
+    pthread_rwlock_init(&tl->lock, NULL);
+    pthread_mutex_init(&tl->fd_lock, NULL);
+    pthread_mutex_init(&tl->journal.lock, NULL);
+    *tlp = tl;
+    pthread_mutex_unlock(&table_locks_lock);
+    return tl;
+}
+
+static void table_lock_put(struct table_lock *tl)
+{
+    pthread_mutex_lock(&table_locks_lock);
+    if (!--tl->users) {
+        tl->lru_next = table_locks_lru_head;
+        if (table_locks_lru_head)
+            table_locks_lru_head->lru_prev = tl;
+        else
+            table_locks_lru_tail = tl;
+        table_locks_lru_head = tl;
+        table_locks_idle++;
+        while (table_locks_idle > TABLE_LOCKS_IDLE) {
+            struct table_lock *old = table_locks_lru_tail;
+            table_lock_lru_remove(old);
+            table_lock_free(old);
+        }
+    }
+    pthread_mutex_unlock(&table_locks_lock);
+}
+
+/* (Re)open the table's handle and flock it, with fd_lock held. If the table
+ * was replaced while we waited for it, use the new one. A new handle may be
+ * on a new table, so its journal is read afresh. */
+static int table_lock_open(struct table_lock *tl, int dir_fd, int exclusive,
+    int create, struct stat *sbuf)
+{
+    struct stat tmp;
+
+    if (!sbuf)
+        sbuf = &tmp;
+    for (;;) {
+        if (tl->fd < 0) {
+            tl->fd = openat(dir_fd, UPFS_META_FILE,
+                create ? (O_RDWR|O_CREAT) : O_RDWR, 0600);
+            if (tl->fd < 0)
+                return -1;
+            pthread_mutex_lock(&tl->journal.lock);
+            journal_map_clear(&tl->journal);
+            pthread_mutex_unlock(&tl->journal.lock);
+        }
+        if (flock(tl->fd, exclusive ? LOCK_EX : LOCK_SH) < 0)
+            return -1;
+        if (fstat(tl->fd, sbuf) < 0) {
+            flock(tl->fd, LOCK_UN);
+            return -1;
+        }
+        if (sbuf->st_nlink)
+            return 0;
+        close(tl->fd);
+        tl->fd = -1;
+    }
+}
+
+/* Take a table, returning its handle, which mustn't be closed. create is as
+ * O_CREAT, and sbuf, if not NULL, gets the table's stat when we're the ones
+ * who locked it (always so if exclusive). */
+static int table_lock_take(struct table_lock *tl, int dir_fd, int exclusive,
+    int create, struct stat *sbuf)
+{
+    struct timespec start, end;
+    int fd = -1, ret;
+
+    ret = exclusive ? pthread_rwlock_trywrlock(&tl->lock) :
+        pthread_rwlock_tryrdlock(&tl->lock);
+    if (ret) {
+        /* Contended, so see how badly */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (exclusive)
+            pthread_rwlock_wrlock(&tl->lock);
+        else
+            pthread_rwlock_rdlock(&tl->lock);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        __atomic_add_fetch(&tl->waits, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&tl->wait_ns,
+            (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000 +
+            end.tv_nsec - start.tv_nsec, __ATOMIC_RELAXED);
+        UPFS_COUNT(table_lock_wait);
+        if (!__atomic_load_n(&tl->path, __ATOMIC_ACQUIRE)) {
+            char proc[64], path[PATH_MAX], *dup;
+            ssize_t len;
+            snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dir_fd);
+            len = readlink(proc, path, PATH_MAX - 1);
+            if (len > 0) {
+                path[len] = 0;
+                char *none = NULL;
+                dup = strdup(path);
+                if (dup && !__atomic_compare_exchange_n(&tl->path, &none, dup,
+                    0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                    free(dup);
+            }
+        }
+    }
+    __atomic_add_fetch(&tl->taken, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&tl->fd_lock);
+    if (exclusive || !tl->readers) {
+        if (table_lock_open(tl, dir_fd, exclusive, create, sbuf) < 0)
+            goto error;
+    } else if (sbuf) {
+        memset(sbuf, 0, sizeof(struct stat));
+    }
+    if (!exclusive)
+        tl->readers++;
+    fd = tl->fd;
+    pthread_mutex_unlock(&tl->fd_lock);
+    return fd;
+
+error:
+    pthread_mutex_unlock(&tl->fd_lock);
+    pthread_rwlock_unlock(&tl->lock);
+    return -1;
+}
+
+static void table_lock_release(struct table_lock *tl, int exclusive)
+{
+    int save_errno = errno;
+
+    pthread_mutex_lock(&tl->fd_lock);
+    if ((exclusive || !--tl->readers) && tl->fd >= 0)
+        flock(tl->fd, LOCK_UN);
+    pthread_mutex_unlock(&tl->fd_lock);
+    pthread_rwlock_unlock(&tl->lock);
+    errno = save_errno;
+}
+
+/* The exclusive holder has replaced the table, so take the new one */
+static int table_lock_retake(struct table_lock *tl, int dir_fd, int create,
+    struct stat *sbuf)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&tl->fd_lock);
+    if (tl->fd >= 0)
+        close(tl->fd);
+    tl->fd = -1;
+    if (table_lock_open(tl, dir_fd, 1, create, sbuf) == 0)
+        fd = tl->fd;
+    pthread_mutex_unlock(&tl->fd_lock);
+    return fd;
+}
+
+/* The table has been removed by its exclusive holder, so the handle is no
+ * longer it */
+static void table_lock_forget(struct table_lock *tl)
+{
+    pthread_mutex_lock(&tl->fd_lock);
+    if (tl->fd >= 0)
+        close(tl->fd);
+    tl->fd = -1;
+    pthread_mutex_unlock(&tl->fd_lock);
+}
+
+void upfs_table_locks_dump(FILE *f)
+{
+    struct table_lock *tl;
+    size_t i;
+
+    pthread_mutex_lock(&table_locks_lock);
+    for (i = 0; i < TABLE_LOCK_BUCKETS; i++) {
+        for (tl = table_locks[i]; tl; tl = tl->next) {
+            if (!tl->path)
+                continue;
+            fprintf(f, "table_lock_taken:%s %llu\n", tl->path,
+                (unsigned long long) tl->taken);
+            fprintf(f, "table_lock_waits:%s %llu\n", tl->path,
+                (unsigned long long) tl->waits);
+            fprintf(f, "table_lock_wait_us:%s %llu\n", tl->path,
+                (unsigned long long) (tl->wait_ns / 1000));
+        }
+    }
+    pthread_mutex_unlock(&table_locks_lock);
+}
+
+/* Directories whose tables we've changed, oldest first, for upfs_tables_tend
+ * to look after. If there are too many, the rest are left until they're
+ * changed again. */
+struct table_dir {
+    struct table_dir *next;
+    dev_t dev;
+    ino_t ino;
+    int dir_fd;
+    struct timespec since;
 };
 
-/* Allocate and initialize a directory entry */
-static off_t upfs_alloc_entry(int tbl_fd, struct upfs_entry *data)
+#define TABLE_DIRS_MAX 1024
+
+static pthread_mutex_t table_dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct table_dir *table_dirs = NULL, **table_dirs_tail = &table_dirs;
+static size_t table_dirs_count = 0;
+
+unsigned int upfs_compact_dead = 0;
+size_t upfs_compact_rate = 0;
+
+/* Remember a directory whose table we're about to change */
+static void table_note(int dir_fd)
+{
+    struct table_dir *td;
+    struct stat sbuf;
+
+    if (fstat(dir_fd, &sbuf) < 0)
+        return;
+
+    pthread_mutex_lock(&table_dirs_lock);
+    for (td = table_dirs; td; td = td->next) {
+        if (td->dev == sbuf.st_dev && td->ino == sbuf.st_ino)
+            goto done;
+    }
+    if (table_dirs_count >= TABLE_DIRS_MAX)
+        goto done;
+    td = malloc(sizeof(struct table_dir));
+    if (!td)
+        goto done;
+    td->dir_fd = dup(dir_fd);
+    if (td->dir_fd < 0) {
+        free(td);
+        goto done;
+    }
+    td->next = NULL;
+    td->dev = sbuf.st_dev;
+    td->ino = sbuf.st_ino;
+    clock_gettime(CLOCK_MONOTONIC, &td->since);
+    *table_dirs_tail = td;
+    table_dirs_tail = &td->next;
+    table_dirs_count++;
+
+done:
+    pthread_mutex_unlock(&table_dirs_lock);
+}
+
+/* Fold the journal of the table in this directory, if it has one, and if
+ * compact, rewrite it if too much of it is dead. Returns how many bytes were
+ * written, or -1 on error. */
+static off_t table_tend(int dir_fd, int compact)
+{
+    struct upfs_header_v2 dh;
+    struct upfs_entry *entries;
+    struct stat sbuf, nsbuf;
+    struct table_lock *tl;
+    size_t count, records;
+    int tbl_fd, rewrite, compacting = 0;
+    int save_errno;
+
+    tl = table_lock_get(dir_fd);
+    if (!tl)
+        return -1;
+    tbl_fd = table_lock_take(tl, dir_fd, 1, 0, &sbuf);
+    if (tbl_fd < 0) {
+        save_errno = errno;
+        table_lock_put(tl);
+        errno = save_errno;
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    memset(&dh, 0, sizeof(struct upfs_header_v2));
+    if (pread_all(tbl_fd, &dh.h, sizeof(struct upfs_header), 0) < 0)
+        goto error;
+    if (memcmp(dh.h.magic, UPFS_MAGIC, UPFS_MAGIC_LENGTH) ||
+        dh.h.version < 1 || dh.h.version > UPFS_VERSION) {
+        errno = EIO;
+        goto error;
+    }
+    if (dh.h.version >= 2 && read_header_v2(tbl_fd, &dh) < 0)
+        goto error;
+
+    rewrite = (dh.h.version >= 2 && dh.journal);
+    if (!rewrite && compact && upfs_compact_dead) {
+        /* Dead records are everything in the table but the live ones */
+        if (table_entries(tbl_fd, &dh, &entries, &count) < 0)
+            goto error;
+        free(entries);
+        if (dh.h.version < 2)
+            records = (sbuf.st_size - sizeof(struct upfs_header)) /
+                sizeof(struct upfs_entry);
+        else
+            records = dh.records;
+        rewrite = compacting = (records > count &&
+            (records - count) * 100 >= records * (size_t) upfs_compact_dead);
+    }
+    if (!rewrite) {
+        table_lock_release(tl, 1);
+        table_lock_put(tl);
+        return 0;
+    }
+
+    if (table_rewrite(dir_fd, tbl_fd, &dh) < 0)
+        goto error;
+    if (compacting)
+        UPFS_COUNT(table_compact);
+    table_lock_forget(tl);
+    table_lock_release(tl, 1);
+    table_lock_put(tl);
+    if (fstatat(dir_fd, UPFS_META_FILE, &nsbuf, 0) < 0)
+        return 0;
+    if (nsbuf.st_size < sbuf.st_size)
+        UPFS_COUNT_N(table_reclaimed_bytes, sbuf.st_size - nsbuf.st_size);
+    return nsbuf.st_size;
+
+error:
+    save_errno = errno;
+    table_lock_release(tl, 1);
+    table_lock_put(tl);
+    errno = save_errno;
+    return -1;
+}
+
+void upfs_tables_tend(double age, int compact)
 {
-    struct upfs_header dh;
-    struct upfs_entry_unused old_de;
-    uint32_t next;
-    ssize_t rd;
-    off_t loc;
+    struct table_dir *td, *due = NULL, **due_tail = &due;
+    struct timespec now, pause;
+    double delay;
+    off_t written;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&table_dirs_lock);
+    while ((td = table_dirs) &&
+        (now.tv_sec - td->since.tv_sec) +
+        (now.tv_nsec - td->since.tv_nsec) / 1e9 >= age) {
+        table_dirs = td->next;
+        if (!table_dirs)
+            table_dirs_tail = &table_dirs;
+        table_dirs_count--;
+        td->next = NULL;
+        *due_tail = td;
+        due_tail = &td->next;
+    }
+    pthread_mutex_unlock(&table_dirs_lock);
+
+    while ((td = due)) {
+        due = td->next;
+        written = table_tend(td->dir_fd, compact);
+        close(td->dir_fd);
+        free(td);
+
+        /* Leave the store to everyone else for a while */
+        if (compact && upfs_compact_rate && written > 0) {
+            delay = (double) written / upfs_compact_rate;
+            pause.tv_sec = (time_t) delay;
+            pause.tv_nsec = (long) ((delay - pause.tv_sec) * 1e9);
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+/* Add entries for those of these names which don't have one yet, writing the
+ * directory's table afresh in one go */
+int upfs_table_claim(int dir_fd, const struct upfs_entry *claims, size_t count)
+{
+    struct upfs_header_v2 dh;
+    struct upfs_entry *entries = NULL, *de;
+    struct table_lock *tl;
+    struct stat sbuf;
+    size_t have = 0, slots, i, j;
+    uint32_t *index = NULL, h;
+    char *c;
+    int tbl_fd, added = 0;
+    int save_errno;
 
-    /* Get the current freelist entry */
-    rd = pread(tbl_fd, &dh, sizeof(struct upfs_header), 0);
-    if (rd < 0) {
+    tl = table_lock_get(dir_fd);
+    if (!tl)
         return -1;
-    } else if (rd != sizeof(struct upfs_header)) {
-        errno = EIO;
+    tbl_fd = table_lock_take(tl, dir_fd, 1, 1, &sbuf);
+    if (tbl_fd < 0) {
+        save_errno = errno;
+        table_lock_put(tl);
+        errno = save_errno;
         return -1;
     }
 
-    /* Extend the file if there's no entry free */
-    if (dh.free_list == (uint32_t) -1) {
-        loc = lseek(tbl_fd, 0, SEEK_END);
-        if (loc == (off_t) -1)
-            return -1;
-
-        if ((loc - sizeof(struct upfs_header)) % sizeof(struct upfs_entry)
-            != 0) {
-            /* Directory table is corrupted! */
+    /* What's there already stays as it is */
+    if (sbuf.st_size > 0) {
+        memset(&dh, 0, sizeof(struct upfs_header_v2));
+        if (pread_all(tbl_fd, &dh.h, sizeof(struct upfs_header), 0) < 0)
+            goto error;
+        if (memcmp(dh.h.magic, UPFS_MAGIC, UPFS_MAGIC_LENGTH) ||
+            dh.h.version < 1 || dh.h.version > UPFS_VERSION) {
             errno = EIO;
-            return -1;
+            goto error;
         }
+        if (dh.h.version >= 2 && read_header_v2(tbl_fd, &dh) < 0)
+            goto error;
+        if (table_entries(tbl_fd, &dh, &entries, &have) < 0)
+            goto error;
+    }
+    de = realloc(entries, (have + count + 1) * sizeof(struct upfs_entry));
+    if (!de)
+        goto error;
+    entries = de;
 
-        if (write(tbl_fd, data, sizeof(struct upfs_entry)) !=
-            sizeof(struct upfs_entry))
-            return -1;
+    /* Index the names by hash, to skip those already there */
+    for (slots = 64; slots < 2 * (have + count); slots *= 2);
+    index = calloc(slots, sizeof(uint32_t));
+    if (!index)
+        goto error;
+    for (i = 0; i < have + count; i++) {
+        if (i >= have) {
+            de = &entries[have + added];
+            *de = claims[i - have];
+            de->name[UPFS_NAME_LENGTH-1] = 0;
+            for (c = de->name; *c; c++)
+                *c = tolower(*c);
+            if (UPFS_IS_META_FILE(de->name))
+                continue;
+        } else {
+            de = &entries[i];
+        }
+        h = name_hash(de->name);
+        for (j = h & (slots - 1); index[j]; j = (j + 1) & (slots - 1)) {
+            if (!strcmp(entries[index[j] - 1].name, de->name))
+                break;
+        }
+        if (index[j])
+            continue;
+        index[j] = (de - entries) + 1;
+        if (i >= have)
+            added++;
+    }
+
+    if (added && table_write(dir_fd, entries, have + added) < 0)
+        goto error;
+    if (added)
+        table_lock_forget(tl);
+    table_lock_release(tl, 1);
+    table_lock_put(tl);
+    free(index);
+    free(entries);
+    return added;
+
+error:
+    save_errno = errno;
+    table_lock_release(tl, 1);
+    table_lock_put(tl);
+    free(index);
+    free(entries);
+    errno = save_errno;
+    return -1;
+}
+
+/****************************************************************
+ * TABLE CACHE
+ ***************************************************************/
+
+/* Tables we've read recently, keyed by the table file's device and inode.
+ * They're checked against its size, times and count of changes before each
+ * use, and our own changes are written through to them. Each keeps a handle
+ * on its table file, to read the count through, which also keeps its inode
+ * from being reused while it's cached. */
+struct cached_entry {
+    struct cached_entry *next;
+    uint32_t hash, uid, gid;
+    uint16_t mode;
+    struct upfs_time mtime, ctime;
+    char name[];
+};
+
+struct upfs_table {
+    struct upfs_table *next, *lru_prev, *lru_next;
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    uint32_t version, changes;
+    off_t size;
+    struct timespec mtime, ctime;
+    size_t count, bucket_count;
+    struct cached_entry **buckets;
+};
+
+#define CACHED_TABLE_BUCKETS 256
+#define CACHED_TABLES_MAX 256
+
+/* The cache, protected by tables_lock. tables_gen counts our own changes, so
+ * that a table read before one isn't cached after it. */
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct upfs_table *tables[CACHED_TABLE_BUCKETS];
+static struct upfs_table *tables_lru_head = NULL, *tables_lru_tail = NULL;
+static size_t tables_entries = 0, tables_count = 0;
+static uint64_t tables_gen = 0;
+
+size_t upfs_table_cache_entries = 65536;
+
+/* Whether a cached table was read from the table file as it is now, given
+ * its stat and count of changes */
+static int cached_table_matches(struct upfs_table *ct, const struct stat *sbuf,
+    uint32_t changes)
+{
+    return ct->size == sbuf->st_size &&
+        ct->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+        ct->mtime.tv_nsec == sbuf->st_mtim.tv_nsec &&
+        ct->ctime.tv_sec == sbuf->st_ctim.tv_sec &&
+        ct->ctime.tv_nsec == sbuf->st_ctim.tv_nsec &&
+        ct->changes == changes;
+}
+
+/* The same, reading the count from the table. This isn't under the table's
+ * lock, but the count is only bumped once a change is complete, so at worst
+ * we miss a change still being made, as if we'd looked a moment earlier. */
+static int cached_table_current(struct upfs_table *ct, const struct stat *sbuf)
+{
+    uint32_t changes = 0;
+
+    if (ct->version >= UPFS_VERSION_HASHED &&
+        pread(ct->fd, &changes, sizeof(uint32_t),
+        offsetof(struct upfs_header_v2, changes)) != sizeof(uint32_t))
+        return 0;
+    return cached_table_matches(ct, sbuf, changes);
+}
+
+static void cached_table_stamp(struct upfs_table *ct, const struct stat *sbuf,
+    uint32_t changes)
+{
+    ct->size = sbuf->st_size;
+    ct->mtime = sbuf->st_mtim;
+    ct->ctime = sbuf->st_ctim;
+    ct->changes = changes;
+}
+
+static struct upfs_table **cached_table_slot(dev_t dev, ino_t ino)
+{
+    struct upfs_table **ctp;
+    for (ctp = &tables[ino % CACHED_TABLE_BUCKETS]; *ctp; ctp = &(*ctp)->next) {
+        if ((*ctp)->dev == dev && (*ctp)->ino == ino)
+            break;
+    }
+    return ctp;
+}
+
+static void cached_table_free(struct upfs_table *ct)
+{
+    struct cached_entry *ce, *next;
+    size_t i;
+
+    for (i = 0; i < ct->bucket_count; i++) {
+        for (ce = ct->buckets[i]; ce; ce = next) {
+            next = ce->next;
+            free(ce);
+        }
+    }
+    free(ct->buckets);
+    if (ct->fd >= 0)
+        close(ct->fd);
+    free(ct);
+}
+
+/* Take a table out of the cache. Called with tables_lock held. */
+static void cached_table_remove(struct upfs_table *ct)
+{
+    struct upfs_table **ctp = cached_table_slot(ct->dev, ct->ino);
+    *ctp = ct->next;
+    if (ct->lru_prev)
+        ct->lru_prev->lru_next = ct->lru_next;
+    else
+        tables_lru_head = ct->lru_next;
+    if (ct->lru_next)
+        ct->lru_next->lru_prev = ct->lru_prev;
+    else
+        tables_lru_tail = ct->lru_prev;
+    tables_entries -= ct->count;
+    tables_count--;
+    cached_table_free(ct);
+}
+
+static void cached_table_touch(struct upfs_table *ct)
+{
+    if (tables_lru_head == ct)
+        return;
+    ct->lru_prev->lru_next = ct->lru_next;
+    if (ct->lru_next)
+        ct->lru_next->lru_prev = ct->lru_prev;
+    else
+        tables_lru_tail = ct->lru_prev;
+    ct->lru_prev = NULL;
+    ct->lru_next = tables_lru_head;
+    tables_lru_head->lru_prev = ct;
+    tables_lru_head = ct;
+}
 
-        return loc;
+static struct cached_entry **cached_entry_slot(struct upfs_table *ct,
+    const char *name, uint32_t hash)
+{
+    struct cached_entry **cep;
+    for (cep = &ct->buckets[hash % ct->bucket_count]; *cep; cep = &(*cep)->next) {
+        if ((*cep)->hash == hash && !strcmp((*cep)->name, name))
+            break;
     }
+    return cep;
+}
+
+static void cached_entry_get(const struct cached_entry *ce, struct upfs_entry *de)
+{
+    memset(de, 0, sizeof(struct upfs_entry));
+    de->uid = ce->uid;
+    de->gid = ce->gid;
+    de->mode = ce->mode;
+    de->mtime = ce->mtime;
+    de->ctime = ce->ctime;
+    strcpy(de->name, ce->name);
+}
+
+static void cached_entry_set(struct cached_entry *ce, const struct upfs_entry *de)
+{
+    ce->uid = de->uid;
+    ce->gid = de->gid;
+    ce->mode = de->mode;
+    ce->mtime = de->mtime;
+    ce->ctime = de->ctime;
+}
 
-    /* There's an entry free, so claim it */
-    loc = sizeof(struct upfs_header) +
-        dh.free_list * sizeof(struct upfs_entry);
-    rd = pread(tbl_fd, &old_de, sizeof(struct upfs_entry_unused), loc);
-    if (rd < 0) {
+/* Add an entry to a cached table. Called with tables_lock held, if the table
+ * is in the cache. */
+static int cached_entry_add(struct upfs_table *ct, const struct upfs_entry *de,
+    uint32_t hash)
+{
+    struct cached_entry *ce, **cep;
+    size_t len = strlen(de->name);
+
+    ce = malloc(sizeof(struct cached_entry) + len + 1);
+    if (!ce)
         return -1;
-    } else if (rd != sizeof(struct upfs_entry_unused)) {
+    ce->hash = hash;
+    cached_entry_set(ce, de);
+    memcpy(ce->name, de->name, len + 1);
+    cep = &ct->buckets[hash % ct->bucket_count];
+    ce->next = *cep;
+    *cep = ce;
+    ct->count++;
+    return 0;
+}
+
+/* Read a whole table, for the cache. It's read under a shared lock, and
+ * stamped with the size, times and count of changes it had then. */
+static struct upfs_table *cached_table_load(int root_fd, const char *path_dir)
+{
+    struct upfs_table *ct = NULL;
+    struct upfs_header_v2 dh;
+    struct upfs_entry *entries = NULL;
+    struct stat sbuf;
+    struct table_lock *tl = NULL;
+    size_t count, i;
+    int dir_fd = -1, tbl_fd = -1, fd = -1, locked = 0;
+    int save_errno;
+
+    dir_fd = open_dir(root_fd, path_dir);
+    if (dir_fd < 0)
+        goto error;
+    tl = table_lock_get(dir_fd);
+    if (!tl)
+        goto error;
+    tbl_fd = table_lock_take(tl, dir_fd, 0, 0, NULL);
+    if (tbl_fd < 0)
+        goto error;
+    locked = 1;
+    if (fstat(tbl_fd, &sbuf) < 0)
+        goto error;
+
+    memset(&dh, 0, sizeof(struct upfs_header_v2));
+    if (pread_all(tbl_fd, &dh.h, sizeof(struct upfs_header), 0) < 0)
+        goto error;
+    if (memcmp(dh.h.magic, UPFS_MAGIC, UPFS_MAGIC_LENGTH) ||
+        dh.h.version < 1 || dh.h.version > UPFS_VERSION) {
         errno = EIO;
-        return -1;
+        goto error;
     }
-    if (old_de.header != (uint32_t) -1) {
-        /* Used entry! */
-        errno = EIO;
-        return -1;
+    if (dh.h.version >= 2 && read_header_v2(tbl_fd, &dh) < 0)
+        goto error;
+    if (table_entries(tbl_fd, &dh, &entries, &count) < 0)
+        goto error;
+
+    /* A handle of our own, as the lock's is shared and closed whenever the
+     * table is replaced. Nobody can replace it while we have it locked. */
+    fd = openat(dir_fd, UPFS_META_FILE, O_RDONLY);
+    if (fd < 0)
+        goto error;
+    table_lock_release(tl, 0);
+    locked = 0;
+    table_lock_put(tl);
+    tl = NULL;
+    close(dir_fd);
+    dir_fd = -1;
+
+    ct = calloc(1, sizeof(struct upfs_table));
+    if (!ct)
+        goto error;
+    ct->dev = sbuf.st_dev;
+    ct->ino = sbuf.st_ino;
+    ct->fd = fd;
+    fd = -1;
+    ct->version = dh.h.version;
+    cached_table_stamp(ct, &sbuf, dh.changes);
+    ct->bucket_count = 16;
+    while (ct->bucket_count < count)
+        ct->bucket_count *= 2;
+    ct->buckets = calloc(ct->bucket_count, sizeof(struct cached_entry *));
+    if (!ct->buckets)
+        goto error;
+    for (i = 0; i < count; i++) {
+        if (cached_entry_add(ct, &entries[i], name_hash(entries[i].name)) < 0)
+            goto error;
+    }
+
+    free(entries);
+    return ct;
+
+error:
+    save_errno = errno;
+    if (ct) {
+        if (ct->buckets) {
+            cached_table_free(ct);
+        } else {
+            close(ct->fd);
+            free(ct);
+        }
     }
-    next = old_de.next;
+    free(entries);
+    if (fd >= 0) close(fd);
+    if (locked) table_lock_release(tl, 0);
+    if (tl) table_lock_put(tl);
+    if (dir_fd >= 0) close(dir_fd);
+    errno = save_errno;
+    return NULL;
+}
+
+/* Look a name up through the cache. Returns 1 if it's there, 0 if it isn't,
+ * or -1 if the cache can't say, in which case the caller should look at the
+ * table itself. */
+static int cached_find(int root_fd, const char *path_dir, const char *name,
+    uint32_t hash, struct upfs_entry *de)
+{
+    char tbl_path[PATH_MAX];
+    struct upfs_table *ct, **ctp;
+    struct cached_entry *ce;
+    struct stat sbuf;
+    uint64_t gen;
+    int ret;
+
+    if (!upfs_table_cache_entries)
+        return -1;
 
-    /* Update the next pointer in the header */
-    dh.free_list = next;
-    if (pwrite(tbl_fd, &dh, sizeof(struct upfs_header), 0) !=
-        sizeof(struct upfs_header))
+    if (!strcmp(path_dir, "."))
+        strcpy(tbl_path, UPFS_META_FILE);
+    else if (snprintf(tbl_path, PATH_MAX, "%s/%s", path_dir, UPFS_META_FILE) >= PATH_MAX)
+        return -1;
+    if (fstatat(root_fd, tbl_path, &sbuf, 0) < 0)
         return -1;
 
-    /* And write the node */
-    if (pwrite(tbl_fd, data, sizeof(struct upfs_entry), loc) !=
-        sizeof(struct upfs_entry))
+    pthread_mutex_lock(&tables_lock);
+    ctp = cached_table_slot(sbuf.st_dev, sbuf.st_ino);
+    ct = *ctp;
+    if (ct && cached_table_current(ct, &sbuf)) {
+        cached_table_touch(ct);
+        UPFS_COUNT(table_cache_hit);
+        goto found;
+    }
+    if (ct)
+        cached_table_remove(ct);
+    gen = tables_gen;
+    pthread_mutex_unlock(&tables_lock);
+
+    UPFS_COUNT(table_cache_miss);
+    ct = cached_table_load(root_fd, path_dir);
+    if (!ct)
         return -1;
 
-    return loc;
+    pthread_mutex_lock(&tables_lock);
+    ctp = cached_table_slot(ct->dev, ct->ino);
+    if (gen != tables_gen || *ctp) {
+        /* We changed something while it was being read, so just use it this
+         * once */
+        ce = *cached_entry_slot(ct, name, hash);
+        if (ce)
+            cached_entry_get(ce, de);
+        pthread_mutex_unlock(&tables_lock);
+        cached_table_free(ct);
+        return !!ce;
+    }
+
+    /* Make room for it */
+    ct->next = NULL;
+    ct->lru_prev = NULL;
+    ct->lru_next = tables_lru_head;
+    if (tables_lru_head)
+        tables_lru_head->lru_prev = ct;
+    else
+        tables_lru_tail = ct;
+    tables_lru_head = ct;
+    *ctp = ct;
+    tables_entries += ct->count;
+    tables_count++;
+    while ((tables_entries > upfs_table_cache_entries ||
+        tables_count > CACHED_TABLES_MAX) && tables_lru_tail != ct)
+        cached_table_remove(tables_lru_tail);
+
+found:
+    ce = *cached_entry_slot(ct, name, hash);
+    ret = !!ce;
+    if (ce)
+        cached_entry_get(ce, de);
+    pthread_mutex_unlock(&tables_lock);
+    return ret;
 }
 
-/* Free (unlink) a directory entry */
-static int upfs_free_entry(int tbl_fd, off_t entry_offset)
+/* We've changed a table through o, setting name to de, or removing it if de
+ * is NULL. Pass the change on to the cached table, if it was current. */
+static void cached_write(struct upfs_open_out *o, int tbl_fd, const char *name,
+    const struct upfs_entry *de)
 {
-    struct upfs_header dh;
-    union {
-        struct upfs_entry e;
-        struct upfs_entry_unused u;
-    } de = {0};
-    ssize_t rd;
+    struct upfs_table *ct;
+    struct cached_entry *ce, **cep;
+    struct stat sbuf;
+    uint32_t hash = name_hash(name);
+    int ok = (fstat(tbl_fd, &sbuf) == 0);
+
+    pthread_mutex_lock(&tables_lock);
+    tables_gen++;
+    ct = *cached_table_slot(o->tbl_sb.st_dev, o->tbl_sb.st_ino);
+    if (ct && (!ok || !cached_table_matches(ct, &o->tbl_sb, o->tbl_changes))) {
+        /* Someone else changed it first */
+        cached_table_remove(ct);
+        ct = NULL;
+    }
+    if (ct) {
+        cep = cached_entry_slot(ct, name, hash);
+        ce = *cep;
+        if (ce && de) {
+            cached_entry_set(ce, de);
+        } else if (ce) {
+            *cep = ce->next;
+            free(ce);
+            ct->count--;
+            tables_entries--;
+        } else if (de) {
+            if (cached_entry_add(ct, de, hash) < 0) {
+                cached_table_remove(ct);
+                ct = NULL;
+            } else {
+                tables_entries++;
+            }
+        }
+    }
+    if (ct)
+        cached_table_stamp(ct, &sbuf, o->dh.changes);
+    pthread_mutex_unlock(&tables_lock);
 
-    /* Get the current freelist entry */
-    rd = pread(tbl_fd, &dh, sizeof(struct upfs_header), 0);
-    if (rd < 0) {
-        return -1;
-    } else if (rd != sizeof(struct upfs_header)) {
-        errno = EIO;
-        return -1;
+    if (ok) {
+        o->tbl_sb = sbuf;
+        o->tbl_changes = o->dh.changes;
+    }
+}
+
+/* Bring a listing's snapshot of a table up to date. A directory without a
+ * table gets an empty one. */
+int upfs_table_refresh(struct upfs_table **table, int dir_fd)
+{
+    struct upfs_table *ct = *table;
+    struct stat sbuf;
+
+    if (fstatat(dir_fd, UPFS_META_FILE, &sbuf, 0) < 0) {
+        if (errno != ENOENT)
+            return -1;
+        if (ct && !ct->ino)
+            return 0;
+        upfs_table_free(ct);
+        *table = NULL;
+        ct = calloc(1, sizeof(struct upfs_table));
+        if (!ct)
+            return -1;
+        ct->fd = -1;
+        ct->bucket_count = 1;
+        ct->buckets = calloc(1, sizeof(struct cached_entry *));
+        if (!ct->buckets) {
+            free(ct);
+            return -1;
+        }
+        *table = ct;
+        return 0;
     }
 
-    /* Link this one in */
-    de.u.header = (uint32_t) -1;
-    de.u.next = dh.free_list;
-    if (pwrite(tbl_fd, &de, sizeof(struct upfs_entry), entry_offset) !=
-        sizeof(struct upfs_entry))
-        return -1;
+    if (ct && ct->dev == sbuf.st_dev && ct->ino == sbuf.st_ino &&
+        cached_table_current(ct, &sbuf))
+        return 0;
+
+    upfs_table_free(ct);
+    *table = cached_table_load(dir_fd, ".");
+    return *table ? 0 : -1;
+}
+
+int upfs_table_fstatat(struct upfs_table *table, const char *name,
+    struct stat *buf)
+{
+    char path_parts[PATH_MAX];
+    char *path_dir, *path_file;
+    struct cached_entry *ce;
 
-    /* And make it the head */
-    entry_offset -= sizeof(struct upfs_header);
-    entry_offset /= sizeof(struct upfs_entry);
-    dh.free_list = entry_offset;
-    if (pwrite(tbl_fd, &dh, sizeof(struct upfs_header), 0)
-        != sizeof(struct upfs_header))
+    split_path(name, path_parts, &path_dir, &path_file, 1);
+    ce = *cached_entry_slot(table, path_file, name_hash(path_file));
+    if (!ce) {
+        errno = ENOENT;
         return -1;
+    }
 
+    memset(buf, 0, sizeof(struct stat));
+    buf->st_mode = ce->mode;
+    buf->st_nlink = 1;
+    buf->st_uid = ce->uid;
+    buf->st_gid = ce->gid;
     return 0;
 }
 
+void upfs_table_free(struct upfs_table *table)
+{
+    if (table)
+        cached_table_free(table);
+}
+
 /* General-purpose permissions file "open". O_CREAT and O_EXCL are as in open,
  * O_APPEND means "open the directory with an exclusive lock", i.e., we intend
  * to change this directory entry. O_TRUNC means we're deleting the entire
- * directory if it's empty. Other flags are ignored. */
+ * directory if it's empty. Other flags are ignored. Exclusive opens upgrade
+ * old tables, so anything written through them is version 2. */
 static int upfs_ps_open(int root_fd, const char *path, int flags, mode_t mode,
     struct upfs_open_out *o)
 {
     char path_parts[PATH_MAX];
     char *path_dir, *path_file;
-    struct upfs_header dh;
+    struct upfs_header_v2 *dh = &o->dh;
     struct upfs_entry de;
-    struct fuse_context *fctx;
+    const struct fuse_ctx *fctx;
+    struct table_lock *tl = NULL;
     int dir_fd = -1, tbl_fd = -1;
     int save_errno;
-    int found = 0, empty = 1;
+    int found = 0, empty = 1, exclusive, locked = 0;
+    uint32_t hash;
+    off_t reuse = 0, torn = 0;
     ssize_t rd;
 
     o->de.uid = (uint32_t) -1;
+    o->created = 0;
     if (o->tbl_fd) *o->tbl_fd = -1;
 
     /* Check for unsupported modes */
@@ -170,43 +1913,71 @@ static int upfs_ps_open(int root_fd, const char *path, int flags, mode_t mode,
         split_path(path, path_parts, &path_dir, &path_file, 1);
     }
 
-    /* The metafile itself is verboten */
-    if (!strcmp(path_file, UPFS_META_FILE)) {
+    /* The metafiles themselves are verboten */
+    if (UPFS_IS_META_FILE(path_file)) {
         errno = EACCES;
         goto error;
     }
+    hash = name_hash(path_file);
+
+    /* Lookups which don't need the table itself can be answered from the
+     * cache, without taking the table's lock. That relies on the count of
+     * changes in the header, which every process bumps after changing the
+     * table in place; its size and times alone can miss changes on FAT. */
+    if (!(flags & (O_APPEND|O_TRUNC)) && !o->tbl_fd) {
+        found = cached_find(root_fd, path_dir, path_file, hash, &de);
+        if (found > 0) {
+            if ((flags&(O_CREAT|O_EXCL)) == (O_CREAT|O_EXCL)) {
+                errno = EEXIST;
+                goto error;
+            }
+            o->de = de;
+            return 0;
+        }
+        if (found == 0 && !(flags & O_CREAT)) {
+            errno = ENOENT;
+            goto error;
+        }
+        found = 0;
+    }
 
     /* First follow the directory */
-    dir_fd = openat(root_fd, path_dir, O_RDONLY);
+    dir_fd = open_dir(root_fd, path_dir);
     if (dir_fd < 0)
         goto error;
+    tl = table_lock_get(dir_fd);
+    if (!tl)
+        goto error;
 
-    /* Now see if there's a directory entry for it */
-    tbl_fd = openat(dir_fd, UPFS_META_FILE, (flags&O_CREAT) ? (O_RDWR|O_CREAT) : O_RDWR, 0600);
+    /* Creating needs the table to ourselves, so take it that way from the
+     * start */
+    if (flags & O_CREAT)
+        flags |= O_APPEND;
+    exclusive = !!(flags & O_APPEND);
+    tbl_fd = table_lock_take(tl, dir_fd, exclusive, flags & O_CREAT,
+        &o->tbl_sb);
     if (tbl_fd < 0)
         goto error; /* Can be a very minor error, but expected upstream */
+    locked = 1;
 
-    if (flock(tbl_fd, (flags&O_APPEND) ? LOCK_EX : LOCK_SH) < 0)
-        goto error;
-
+retry:
     /* Check the header */
-    rd = read(tbl_fd, &dh, sizeof(struct upfs_header));
+    memset(dh, 0, sizeof(struct upfs_header_v2));
+    rd = pread(tbl_fd, &dh->h, sizeof(struct upfs_header), 0);
     if (rd == 0 && (flags&O_CREAT)) {
-        /* Fresh table, make the hader */
-        memcpy(dh.magic, UPFS_MAGIC, UPFS_MAGIC_LENGTH);
-        dh.version = UPFS_VERSION;
-        dh.free_list = (uint32_t) -1;
-        if (write(tbl_fd, &dh, sizeof(struct upfs_header)) != sizeof(struct upfs_header)) {
-            errno = EIO;
+        /* Fresh table, make the header */
+        if (table_init(tbl_fd, dh) < 0)
             goto error;
-        }
 
     } else if (rd == sizeof(struct upfs_header)) {
         /* Check that it's a UPFS directory table */
-        if (memcmp(dh.magic, UPFS_MAGIC, UPFS_MAGIC_LENGTH) || dh.version > UPFS_VERSION) {
+        if (memcmp(dh->h.magic, UPFS_MAGIC, UPFS_MAGIC_LENGTH) ||
+            dh->h.version < 1 || dh->h.version > UPFS_VERSION) {
             errno = EIO;
             goto error;
         }
+        if (dh->h.version >= 2 && read_header_v2(tbl_fd, dh) < 0)
+            goto error;
 
     } else if (rd < 0) {
         /* Error reading the table file! */
@@ -218,23 +1989,73 @@ static int upfs_ps_open(int root_fd, const char *path, int flags, mode_t mode,
         goto error;
     }
 
-    /* Now read the directory entries */
-    while (read(tbl_fd, &de, sizeof(struct upfs_entry)) ==
-        sizeof(struct upfs_entry)) {
-        if (de.uid != (uint32_t) -1) {
-            empty = 0;
-            if (!strncmp(path_file, de.name, UPFS_NAME_LENGTH)) {
-                /* Found it! */
-                found = 1;
-                break;
+    o->tbl_changes = dh->changes;
+
+    /* Upgrade old tables, grow full ones, and fold in journals which are long
+     * or unwanted, while they're ours alone */
+    if (exclusive && !(flags & O_TRUNC) &&
+        (dh->h.version < 2 || dh->records > 2 * dh->bucket_count ||
+         (dh->journal && (!upfs_journal_max ||
+          o->tbl_sb.st_size > dh->journal + (off_t) upfs_journal_max)))) {
+        if (table_rewrite(dir_fd, tbl_fd, dh) < 0)
+            goto error;
+        tbl_fd = table_lock_retake(tl, dir_fd, flags & O_CREAT, &o->tbl_sb);
+        if (tbl_fd < 0)
+            goto error;
+        goto retry;
+    }
+
+    /* Now find the directory entry */
+    if (flags & O_TRUNC) {
+        struct upfs_entry *entries;
+        size_t count;
+        if (table_entries(tbl_fd, dh, &entries, &count) < 0)
+            goto error;
+        free(entries);
+        empty = !count;
+
+    } else if (dh->h.version < 2) {
+        off_t off = sizeof(struct upfs_header);
+        while (pread(tbl_fd, &de, sizeof(struct upfs_entry), off) ==
+            sizeof(struct upfs_entry)) {
+            if (de.uid != (uint32_t) -1) {
+                empty = 0;
+                if (!strncmp(path_file, de.name, UPFS_NAME_LENGTH)) {
+                    /* Found it! */
+                    found = 1;
+                    o->tbl_off = off;
+                    break;
+                }
             }
+            off += sizeof(struct upfs_entry);
         }
+
+    } else {
+        found = lookup_entry(tbl_fd, dh, &tl->journal, path_file, hash, &de,
+            &o->tbl_off, (flags & O_CREAT) ? &reuse : NULL,
+            exclusive ? &torn : NULL);
+        if (found < 0)
+            goto error;
+
+        /* A crash may have torn the journal's last record. Drop it, or what we
+         * add after it would be lost too. What we add may bring the table
+         * back to the same size, so this counts as a change. */
+        if (torn && (ftruncate(tbl_fd, torn) < 0 ||
+            table_changed(tbl_fd, dh) < 0 ||
+            fstat(tbl_fd, &o->tbl_sb) < 0))
+            goto error;
+        o->tbl_changes = dh->changes;
+
+        if (exclusive && (JOURNALING(dh) || upfs_compact_dead))
+            table_note(dir_fd);
+
     }
 
     if (flags & O_TRUNC) {
         if (empty) {
             /* Delete the empty table */
             unlinkat(dir_fd, UPFS_META_FILE, 0);
+            table_lock_forget(tl);
         }
 
     } else if (found) {
@@ -246,29 +2067,22 @@ static int upfs_ps_open(int root_fd, const char *path, int flags, mode_t mode,
 
         /* Tell the caller */
         o->de = de;
-        if (o->tbl_fd) *o->tbl_fd = tbl_fd;
-        o->tbl_off = lseek(tbl_fd, 0, SEEK_CUR) - sizeof(struct upfs_entry);
 
     } else if (flags & O_CREAT) {
-        if (!(flags & O_APPEND)) {
-            /* Need an exclusive lock to create a new entry */
-            close(tbl_fd);
-            return upfs_ps_open(root_fd, path, flags|O_APPEND, mode, o);
-        }
-
         /* Create an entry for it */
         memset(&de, 0, sizeof(struct upfs_entry));
 
-        fctx = fuse_get_context();
+        fctx = upfs_get_context();
         de.uid = fctx->uid;
         de.gid = fctx->gid;
         de.mode = mode;
         strncpy(de.name, path_file, UPFS_NAME_LENGTH-1);
-        o->tbl_off = upfs_alloc_entry(tbl_fd, &de);
+        o->tbl_off = alloc_entry(tbl_fd, dh, &de, hash, reuse);
         if (o->tbl_off == (off_t) -1)
             goto error;
+        cached_write(o, tbl_fd, de.name, &de);
         o->de = de;
-        if (o->tbl_fd) *o->tbl_fd = tbl_fd;
+        o->created = 1;
 
     } else {
         /* Not found */
@@ -277,8 +2091,15 @@ static int upfs_ps_open(int root_fd, const char *path, int flags, mode_t mode,
 
     }
 
-    if (!o->tbl_fd)
-        close(tbl_fd);
+    if (o->tbl_fd && !(flags & O_TRUNC)) {
+        /* The caller lets go with ps_close */
+        *o->tbl_fd = tbl_fd;
+        o->lock = tl;
+        o->exclusive = exclusive;
+    } else {
+        table_lock_release(tl, exclusive);
+        table_lock_put(tl);
+    }
     close(dir_fd);
 
     return 0;
@@ -286,11 +2107,22 @@ static int upfs_ps_open(int root_fd, const char *path, int flags, mode_t mode,
 error:
     save_errno = errno;
     if (dir_fd >= 0) close(dir_fd);
-    if (tbl_fd >= 0) close(tbl_fd);
+    if (locked) table_lock_release(tl, exclusive);
+    if (tl) table_lock_put(tl);
     errno = save_errno;
     return -1;
 }
 
+/* Let go of a table upfs_ps_open gave us */
+static void ps_close(struct upfs_open_out *o)
+{
+    if (o->lock) {
+        table_lock_release(o->lock, o->exclusive);
+        table_lock_put(o->lock);
+        o->lock = NULL;
+    }
+}
+
 /* Current time in UpFS format */
 struct upfs_time time_now(void)
 {
@@ -302,6 +2134,17 @@ struct upfs_time time_now(void)
     return ret;
 }
 
+/* Set an entry's mtime as utimensat would */
+static void set_mtime(struct upfs_entry *de, const struct timespec *times)
+{
+    if (!times || times[1].tv_nsec == UTIME_NOW) {
+        de->mtime = time_now();
+    } else if (times[1].tv_nsec != UTIME_OMIT) {
+        de->mtime.sec = times[1].tv_sec;
+        de->mtime.nsec = times[1].tv_nsec;
+    }
+}
+
 /* Unlink the index file in this directory if (and only if) it's empty */
 int upfs_unlink_empty_index(int dir_fd, const char *path)
 {
@@ -363,18 +2206,20 @@ int upfs_unlinkat(int dir_fd, const char *path, int flags)
 
     if ((S_ISDIR(o.de.mode) && !(flags & AT_REMOVEDIR)) ||
         (!S_ISDIR(o.de.mode) && (flags & AT_REMOVEDIR))) {
+        ps_close(&o);
         errno = EPERM;
         return -1;
     }
 
-    if (upfs_free_entry(tbl_fd, o.tbl_off) < 0) {
+    if (free_entry(tbl_fd, &o.dh, o.tbl_off, o.de.name) < 0) {
         int save_errno = errno;
-        close(tbl_fd);
+        ps_close(&o);
         errno = save_errno;
         return -1;
     }
+    cached_write(&o, tbl_fd, o.de.name, NULL);
 
-    close(tbl_fd);
+    ps_close(&o);
     return 0;
 }
 
@@ -390,15 +2235,14 @@ static int upfs_fchmodat_prime(int dir_fd, const char *path, mode_t mode, int fu
     else
         o.de.mode = (o.de.mode&S_IFMT) | (mode&07777);
     o.de.ctime = time_now();
-    if (pwrite(tbl_fd, &o.de, sizeof(struct upfs_entry), o.tbl_off) !=
-        sizeof(struct upfs_entry)) {
+    if (write_entry(tbl_fd, &o.dh, o.tbl_off, &o.de) < 0) {
         int save_errno = errno;
-        close(tbl_fd);
+        ps_close(&o);
         errno = save_errno;
-        if (!errno) errno = EIO;
         return -1;
     }
-    close(tbl_fd);
+    cached_write(&o, tbl_fd, o.de.name, &o.de);
+    ps_close(&o);
     return 0;
 }
 
@@ -422,6 +2266,7 @@ int upfs_renameat(int old_dir_fd, const char *old_path,
     char old_path_parts[PATH_MAX], *old_path_dir, *old_path_file;
     char new_path_parts[PATH_MAX], *new_path_dir, *new_path_file;
     struct stat old_sbuf, new_sbuf;
+    int found;
     int save_errno;
     oo.tbl_fd = &old_tbl_fd;
     no.tbl_fd = &new_tbl_fd;
@@ -429,10 +2274,10 @@ int upfs_renameat(int old_dir_fd, const char *old_path,
     /* Figure out if we're in the special case of the same directory */
     split_path(old_path, old_path_parts, &old_path_dir, &old_path_file, 1);
     split_path(new_path, new_path_parts, &new_path_dir, &new_path_file, 1);
-    old_subdir_fd = openat(old_dir_fd, old_path_dir, O_RDONLY);
+    old_subdir_fd = open_dir(old_dir_fd, old_path_dir);
     if (old_subdir_fd < 0)
         goto done;
-    new_subdir_fd = openat(new_dir_fd, new_path_dir, O_RDONLY);
+    new_subdir_fd = open_dir(new_dir_fd, new_path_dir);
     if (new_subdir_fd < 0)
         goto done;
     if (fstat(old_subdir_fd, &old_sbuf) < 0)
@@ -445,47 +2290,51 @@ int upfs_renameat(int old_dir_fd, const char *old_path,
         close(old_subdir_fd);
         old_subdir_fd = -1;
 
-        /* Same directory. We need to do this carefully. */
-        while (1) {
-            oo.tbl_fd = NULL;
-            if (upfs_ps_open(new_subdir_fd, old_path_file, 0, 0, &oo) < 0)
-                goto done;
-            if (upfs_ps_open(new_subdir_fd, new_path_file, O_APPEND|O_CREAT, S_IFREG, &no) < 0)
-                goto done;
-
-            /* Verify that the old file is still there */
-            if (pread(new_tbl_fd, &oo.de, sizeof(struct upfs_entry),
-                    oo.tbl_off) !=
-                sizeof(struct upfs_entry))
-                goto done;
-            if (oo.de.uid == (uint32_t) -1 || strncmp(oo.de.name, old_path_file, UPFS_NAME_LENGTH))
-                continue;
-
-            /* If the metadata is in the same spot, we're done */
-            if (oo.tbl_off == no.tbl_off) {
-                ret = 0;
-                goto done;
-            }
-
-            /* Copy over the metadata (FIXME: More automation please) */
-            no.de.uid = oo.de.uid;
-            no.de.gid = oo.de.gid;
-            no.de.mode = oo.de.mode;
-            no.de.reserved = 0;
-            no.de.mtime = oo.de.mtime;
-            no.de.ctime = oo.de.ctime;
-            if (pwrite(new_tbl_fd, &no.de, sizeof(struct upfs_entry),
-                    no.tbl_off) !=
-                sizeof(struct upfs_entry))
-                goto done;
-
-            /* And remove the old one */
-            if (upfs_free_entry(new_tbl_fd, oo.tbl_off) < 0)
-                goto done;
+        /* Same directory, so it's all one table. Make sure the old name is
+         * there, then take the table for ourselves and find it again. */
+        oo.tbl_fd = NULL;
+        if (upfs_ps_open(new_subdir_fd, old_path_file, 0, 0, &oo) < 0)
+            goto done;
+        if (upfs_ps_open(new_subdir_fd, new_path_file, O_APPEND|O_CREAT, S_IFREG, &no) < 0)
+            goto done;
+        found = lookup_entry(new_tbl_fd, &no.dh, &no.lock->journal,
+            old_path_file, name_hash(old_path_file), &oo.de, &oo.tbl_off,
+            NULL, NULL);
+        if (found <= 0) {
+            /* It went away in the meantime */
+            if (!found) errno = ENOENT;
+            save_errno = errno;
+            if (no.created &&
+                free_entry(new_tbl_fd, &no.dh, no.tbl_off, no.de.name) == 0)
+                cached_write(&no, new_tbl_fd, no.de.name, NULL);
+            errno = save_errno;
+            goto done;
+        }
 
+        /* If it's the same entry, we're done */
+        if (!strcmp(oo.de.name, no.de.name)) {
             ret = 0;
             goto done;
         }
+
+        /* Copy over the metadata (FIXME: More automation please) */
+        no.de.uid = oo.de.uid;
+        no.de.gid = oo.de.gid;
+        no.de.mode = oo.de.mode;
+        no.de.reserved = 0;
+        no.de.mtime = oo.de.mtime;
+        no.de.ctime = oo.de.ctime;
+        if (write_entry(new_tbl_fd, &no.dh, no.tbl_off, &no.de) < 0)
+            goto done;
+        cached_write(&no, new_tbl_fd, no.de.name, &no.de);
+
+        /* And remove the old one */
+        if (free_entry(new_tbl_fd, &no.dh, oo.tbl_off, oo.de.name) < 0)
+            goto done;
+        cached_write(&no, new_tbl_fd, oo.de.name, NULL);
+
+        ret = 0;
+        goto done;
     }
 
     /* They're in different directories. */
@@ -493,7 +2342,7 @@ int upfs_renameat(int old_dir_fd, const char *old_path,
     /* First stat both locations */
     if (upfs_ps_open(old_subdir_fd, old_path_file, O_APPEND, 0, &oo) < 0)
         goto done;
-    if (upfs_ps_open(new_subdir_fd, new_path_file, O_CREAT, 0, &no) < 0)
+    if (upfs_ps_open(new_subdir_fd, new_path_file, O_APPEND|O_CREAT, 0, &no) < 0)
         goto done;
 
     /* Check for an incompatible move. (FIXME: Need to check for empty
@@ -513,8 +2362,8 @@ int upfs_renameat(int old_dir_fd, const char *old_path,
     if (old_sbuf.st_ino == new_sbuf.st_ino &&
         old_sbuf.st_dev == new_sbuf.st_dev) {
         /* We're done, no real move */
-        close(old_tbl_fd);
-        close(new_tbl_fd);
+        ps_close(&oo);
+        ps_close(&no);
         return 0;
     }
 
@@ -526,15 +2375,15 @@ int upfs_renameat(int old_dir_fd, const char *old_path,
     no.de.reserved = 0;
     no.de.mtime = oo.de.mtime;
     no.de.ctime = oo.de.ctime;
-    if (pwrite(new_tbl_fd, &no.de, sizeof(struct upfs_entry), no.tbl_off) !=
-        sizeof(struct upfs_entry))
+    if (write_entry(new_tbl_fd, &no.dh, no.tbl_off, &no.de) < 0)
         goto done;
-    close(new_tbl_fd);
-    new_tbl_fd = -1;
+    cached_write(&no, new_tbl_fd, no.de.name, &no.de);
+    ps_close(&no);
 
     /* And remove the old one */
-    if (upfs_free_entry(old_tbl_fd, oo.tbl_off) < 0)
+    if (free_entry(old_tbl_fd, &oo.dh, oo.tbl_off, oo.de.name) < 0)
         goto done;
+    cached_write(&oo, old_tbl_fd, oo.de.name, NULL);
 
     ret = 0;
 
@@ -542,8 +2391,8 @@ done:
     save_errno = errno;
     if (old_subdir_fd >= 0) close(old_subdir_fd);
     if (new_subdir_fd >= 0) close(new_subdir_fd);
-    if (old_tbl_fd >= 0) close(old_tbl_fd);
-    if (new_tbl_fd >= 0) close(new_tbl_fd);
+    ps_close(&oo);
+    ps_close(&no);
     errno = save_errno;
     return ret;
 }
@@ -557,95 +2406,61 @@ int upfs_fchownat(int dir_fd, const char *path, uid_t owner, gid_t group,
     if (upfs_ps_open(dir_fd, path, O_APPEND, 0, &o) < 0)
         return -1;
 
-    o.de.uid = owner;
-    o.de.gid = group;
+    if (owner != (uid_t) -1)
+        o.de.uid = owner;
+    if (group != (gid_t) -1)
+        o.de.gid = group;
     o.de.ctime = time_now();
-    if (pwrite(tbl_fd, &o.de, sizeof(struct upfs_entry), o.tbl_off) !=
-        sizeof(struct upfs_entry)) {
+    if (write_entry(tbl_fd, &o.dh, o.tbl_off, &o.de) < 0) {
         int save_errno = errno;
-        close(tbl_fd);
+        ps_close(&o);
         errno = save_errno;
         return -1;
     }
+    cached_write(&o, tbl_fd, o.de.name, &o.de);
 
-    close(tbl_fd);
+    ps_close(&o);
     return 0;
 }
 
 int upfs_openat(int dir_fd, const char *path, int flags, mode_t mode)
 {
-    int tbl_fd;
+    char path_parts[PATH_MAX];
+    char *path_dir, *path_file;
     struct upfs_open_out o = {0};
+    int tbl_fd, sub_fd, fd;
 
     if (flags & O_DIRECTORY) {
         /* We need to open this as a directory, not its entry */
         return openat(dir_fd, path, flags, mode);
     }
 
+    /* Through the table itself, for the entry's offset */
     o.tbl_fd = &tbl_fd;
     if (upfs_ps_open(dir_fd, path, flags&(O_CREAT|O_EXCL), S_IFREG|(mode&0777), &o) < 0)
         return -1;
+    ps_close(&o);
+
+    /* UpFS gets a handle of its own on the table, which isn't locked, so
+     * that locking doesn't go too stupid */
+    split_path(path, path_parts, &path_dir, &path_file, 1);
+    sub_fd = open_dir(dir_fd, path_dir);
+    if (sub_fd < 0)
+        return -1;
+    fd = openat(sub_fd, UPFS_META_FILE, O_RDWR);
+    close(sub_fd);
+    if (fd < 0)
+        return -1;
 
     /* So that the fd is actually useable, seek it properly */
-    if (lseek(tbl_fd, o.tbl_off, SEEK_SET) == (off_t) -1) {
+    if (lseek(fd, o.tbl_off, SEEK_SET) == (off_t) -1) {
         int save_errno = errno;
-        close(tbl_fd);
+        close(fd);
         errno = save_errno;
         return -1;
     }
 
-    /* We give UpFS tbl_fd, but to prevent locking from going too stupid, we
-     * don't give it locked */
-    flock(tbl_fd, LOCK_UN);
-
-    return tbl_fd;
-}
-
-int upfs_futimens(int fd, const struct timespec *times)
-{
-    /* This is a screwy function for a lot of reasons. First and foremost, we
-     * can't verify that nobody's deleted nodes, so we may actually be updating
-     * the modification times of an unrelated file. That's reasonably harmless,
-     * so rather than keeping gross locks around, we let the bug be */
-    struct upfs_entry de;
-    off_t loc;
-    int save_errno;
-
-    if (flock(fd, LOCK_EX) < 0)
-        return -1;
-
-    loc = lseek(fd, 0, SEEK_CUR);
-    if (loc == (off_t) -1)
-        goto error;
-
-    if (pread(fd, &de, sizeof(struct upfs_entry), loc) !=
-        sizeof(struct upfs_entry))
-        goto error;
-
-    if (de.uid == (uint32_t) -1) {
-        errno = EIO;
-        goto error;
-    }
-
-    if (times) {
-        de.mtime.sec = times[1].tv_sec;
-        de.mtime.nsec = times[1].tv_nsec;
-    } else {
-        de.mtime = time_now();
-    }
-
-    if (pwrite(fd, &de, sizeof(struct upfs_entry), loc) !=
-        sizeof(struct upfs_entry))
-        goto error;
-
-    flock(fd, LOCK_UN);
-    return 0;
-
-error:
-    save_errno = errno;
-    flock(fd, LOCK_UN);
-    errno = save_errno;
-    return -1;
+    return fd;
 }
 
 int upfs_utimensat(int dir_fd, const char *path, const struct timespec *times,
@@ -657,21 +2472,16 @@ int upfs_utimensat(int dir_fd, const char *path, const struct timespec *times,
     if (upfs_ps_open(dir_fd, path, O_APPEND, 0, &o) < 0)
         return -1;
 
-    if (times) {
-        o.de.mtime.sec = times[1].tv_sec;
-        o.de.mtime.nsec = times[1].tv_nsec;
-    } else {
-        o.de.mtime = time_now();
-    }
+    set_mtime(&o.de, times);
 
-    if (pwrite(tbl_fd, &o.de, sizeof(struct upfs_entry), o.tbl_off) !=
-        sizeof(struct upfs_entry)) {
+    if (write_entry(tbl_fd, &o.dh, o.tbl_off, &o.de) < 0) {
         int save_errno = errno;
-        close(tbl_fd);
+        ps_close(&o);
         errno = save_errno;
         return -1;
     }
+    cached_write(&o, tbl_fd, o.de.name, &o.de);
 
-    close(tbl_fd);
+    ps_close(&o);
     return 0;
 }
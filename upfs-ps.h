@@ -3,23 +3,33 @@
 #ifndef UPFS_PS_H
 #define UPFS_PS_H 1
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
-#define UPFS_VERSION            1
+/* The newest version we understand, the version of tables as we write them
+ * afresh, and the version of tables with a journal */
+#define UPFS_VERSION            3
+#define UPFS_VERSION_HASHED     2
+#define UPFS_VERSION_JOURNAL    3
 
 #define UPFS_NAME_LENGTH        256
 #define UPFS_META_FILE          ".upfs"
+#define UPFS_META_TEMP          ".upfs.new"
 #define UPFS_MAGIC              "UpFSPTbl"
 #define UPFS_MAGIC_LENGTH       8
 
 /* The mode bits we support */
 #define UPFS_SUPPORTED_MODES    (07777|S_IFREG|S_IFDIR|S_IFLNK|S_IFIFO|S_IFSOCK)
 
+/* Every version starts with this header */
 struct upfs_header {
     char magic[UPFS_MAGIC_LENGTH];
     uint32_t version, free_list;
 };
 
+/* Version 1 tables are this header followed by an array of entries, free ones
+ * linked from free_list */
 struct upfs_entry_unused {
     uint32_t header, next;
 };
@@ -37,6 +47,97 @@ struct upfs_entry {
     char name[UPFS_NAME_LENGTH];
 };
 
+/* Version 2 tables are a hash table of records, keyed on their (already
+ * case-folded) name. The header is followed by records, their names and the
+ * bucket array, in no particular order; everything is found by its offset in
+ * the file. free_list is unused. */
+struct upfs_header_v2 {
+    struct upfs_header h;
+
+    /* The bucket array, each the offset of the first record in its chain */
+    uint32_t buckets, bucket_count;
+
+    /* How many records are in the chains, live or not */
+    uint32_t records;
+
+    /* Where the journal starts, in version 3 tables */
+    uint32_t journal;
+
+    /* Counts changes made in place, each bumped once it's complete. They
+     * needn't change the table's size, nor, within the resolution of FAT's
+     * timestamps, its times, so this is how a cached copy knows it's out of
+     * date. Journaled changes always grow the table instead. */
+    uint32_t changes;
+
+    uint32_t reserved[1];
+};
+
+struct upfs_record {
+    /* uid is -1 if this record is unused. Unused records stay in their chain
+     * until the table is rewritten, and may be reused for a name which fits
+     * in the old one's space. */
+    uint32_t uid, gid;
+    uint16_t mode, name_length;
+
+    /* The hash of the name, the next record in the chain (0 at the end), and
+     * where the name is */
+    uint32_t hash, next, name;
+
+    struct upfs_time mtime, ctime;
+};
+
+#define UPFS_V2_MIN_BUCKETS     64
+
+/* Version 3 tables are version 2 tables with a journal of later changes
+ * appended, from the header's journal offset to the end of the file. Each
+ * record sets one name's entry, or removes it if uid is -1, and is followed by
+ * the name, padded to 8 bytes. check is the FNV-1a of the 32-bit words of all
+ * that after check itself, so a record torn by a crash, and anything after it,
+ * is ignored.
+ * Journals are folded back in by rewriting the table as version 2. */
+struct upfs_journal_record {
+    uint32_t check;
+    uint32_t uid, gid;
+    uint16_t mode, name_length;
+    struct upfs_time mtime, ctime;
+};
+
+/* Whether a name is one of our own files */
+#define UPFS_IS_META_FILE(name) \
+    (!strcmp((name), UPFS_META_FILE) || !strcmp((name), UPFS_META_TEMP))
+
+/* How many entries of recently used tables to keep in memory */
+extern size_t upfs_table_cache_entries;
+
+/* How long a table's journal may grow before it's folded back in, or 0 to
+ * change tables in place */
+extern size_t upfs_journal_max;
+
+/* How much of a table, in percent, may be dead records before it's compacted,
+ * or 0 never to, and how many bytes a second compaction may write */
+extern unsigned int upfs_compact_dead;
+extern size_t upfs_compact_rate;
+
+/* Look after the tables changed more than age seconds ago: fold their journals
+ * back in, and if compact, compact those with too many dead records */
+void upfs_tables_tend(double age, int compact);
+
+/* Give entries to those of these names in a directory which don't have one,
+ * writing its table afresh in one go. Names are folded as the table expects.
+ * Returns how many were added, or -1. */
+int upfs_table_claim(int dir_fd, const struct upfs_entry *claims, size_t count);
+
+/* Write how contended each directory's table has been, for the statistics */
+void upfs_table_locks_dump(FILE *f);
+
+/* A snapshot of a directory's table, for listing it. refresh (re)reads it if
+ * it's missing or out of date. */
+struct upfs_table;
+int upfs_table_refresh(struct upfs_table **table, int dir_fd);
+int upfs_table_fstatat(struct upfs_table *table, const char *name,
+    struct stat *buf);
+void upfs_table_free(struct upfs_table *table);
+
 int upfs_unlink_empty_index(int dir_fd, const char *path);
 
 /****************************************************************
@@ -52,7 +153,6 @@ int upfs_renameat(int old_dir_fd, const char *old_path,
 int upfs_fchownat(int dir_fd, const char *path, uid_t owner, gid_t group,
     int flags);
 int upfs_openat(int dir_fd, const char *path, int flags, mode_t mode);
-int upfs_futimens(int fd, const struct timespec *times);
 int upfs_utimensat(int dir_fd, const char *path, const struct timespec *times,
     int flags);
 
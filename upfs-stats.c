@@ -0,0 +1,134 @@
+#define _GNU_SOURCE /* syscall */
+
+#include "upfs-stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+uint64_t upfs_stats[UPFS_STAT_COUNT];
+uint64_t upfs_hists[UPFS_HIST_COUNT][UPFS_HIST_BUCKETS];
+
+static const char *upfs_stat_names[UPFS_STAT_COUNT] = {
+#define UPFS_STAT_NAME(name) #name,
+    UPFS_STATS(UPFS_STAT_NAME)
+#undef UPFS_STAT_NAME
+};
+
+static const char *upfs_hist_names[UPFS_HIST_COUNT] = {
+#define UPFS_HIST_NAME(name) #name,
+    UPFS_HISTS(UPFS_HIST_NAME)
+#undef UPFS_HIST_NAME
+};
+
+/* Each worker thread's statistics, while it lives */
+struct upfs_worker_stats {
+    struct upfs_worker_stats *next, **prev;
+    long tid;
+    uint64_t requests;
+};
+
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct upfs_worker_stats *workers = NULL;
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t worker_key;
+static __thread struct upfs_worker_stats *worker;
+
+/* Workers which have exited, when FUSE has more idle than it wants */
+static uint64_t retired_workers = 0, retired_requests = 0;
+
+static void worker_exit(void *vw)
+{
+    struct upfs_worker_stats *w = vw;
+    pthread_mutex_lock(&workers_lock);
+    *w->prev = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    retired_workers++;
+    retired_requests += w->requests;
+    pthread_mutex_unlock(&workers_lock);
+    free(w);
+}
+
+static void worker_key_init(void)
+{
+    pthread_key_create(&worker_key, worker_exit);
+}
+
+void upfs_stats_worker_request(void)
+{
+    struct upfs_worker_stats *w = worker;
+
+    if (!w) {
+        /* First request on this thread */
+        w = calloc(1, sizeof(struct upfs_worker_stats));
+        if (!w)
+            return;
+        w->tid = syscall(SYS_gettid);
+        pthread_once(&worker_key_once, worker_key_init);
+        pthread_mutex_lock(&workers_lock);
+        w->next = workers;
+        w->prev = &workers;
+        if (workers)
+            workers->prev = &w->next;
+        workers = w;
+        pthread_mutex_unlock(&workers_lock);
+        pthread_setspecific(worker_key, w);
+        worker = w;
+        UPFS_COUNT(workers_started);
+    }
+
+    __atomic_add_fetch(&w->requests, 1, __ATOMIC_RELAXED);
+}
+
+void upfs_stats_time(enum upfs_hist hist, double seconds)
+{
+    uint64_t us = (seconds > 0) ? (uint64_t) (seconds * 1e6) : 0;
+    int bucket = 0;
+
+    while (us && bucket < UPFS_HIST_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    __atomic_add_fetch(&upfs_hists[hist][bucket], 1, __ATOMIC_RELAXED);
+}
+
+void upfs_stats_dump(FILE *f)
+{
+    int i, b;
+    uint64_t count;
+    struct upfs_worker_stats *w;
+
+    for (i = 0; i < UPFS_STAT_COUNT; i++) {
+        fprintf(f, "%s %llu\n", upfs_stat_names[i], (unsigned long long)
+            __atomic_load_n(&upfs_stats[i], __ATOMIC_RELAXED));
+    }
+
+    /* Each bucket counts the times below its bound, and at least the last
+     * bucket's */
+    for (i = 0; i < UPFS_HIST_COUNT; i++) {
+        for (b = 0; b < UPFS_HIST_BUCKETS; b++) {
+            count = __atomic_load_n(&upfs_hists[i][b], __ATOMIC_RELAXED);
+            if (!count)
+                continue;
+            if (b == UPFS_HIST_BUCKETS - 1)
+                fprintf(f, "%s_inf %llu\n", upfs_hist_names[i],
+                    (unsigned long long) count);
+            else
+                fprintf(f, "%s_lt_%llu %llu\n", upfs_hist_names[i],
+                    1ULL << b, (unsigned long long) count);
+        }
+    }
+
+    pthread_mutex_lock(&workers_lock);
+    for (w = workers; w; w = w->next) {
+        fprintf(f, "worker_%ld_requests %llu\n", w->tid, (unsigned long long)
+            __atomic_load_n(&w->requests, __ATOMIC_RELAXED));
+    }
+    fprintf(f, "workers_retired %llu\n",
+        (unsigned long long) retired_workers);
+    fprintf(f, "workers_retired_requests %llu\n",
+        (unsigned long long) retired_requests);
+    pthread_mutex_unlock(&workers_lock);
+}
@@ -0,0 +1,86 @@
+/* Counters for measuring UpFS */
+
+#ifndef UPFS_STATS_H
+#define UPFS_STATS_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Every counter we keep */
+#define UPFS_STATS(X) \
+    X(lookup) \
+    X(getattr) \
+    X(readdir) \
+    X(readdirplus) \
+    X(write) \
+    X(read_requested_bytes) \
+    X(write_bytes) \
+    X(dir_fd_hit) \
+    X(dir_fd_miss) \
+    X(dir_fd_evict) \
+    X(neg_perm_hit) \
+    X(neg_store_hit) \
+    X(neg_perm_dir_hit) \
+    X(table_cache_hit) \
+    X(table_cache_miss) \
+    X(journal_append) \
+    X(journal_checkpoint) \
+    X(table_compact) \
+    X(table_reclaimed_bytes) \
+    X(table_lock_wait) \
+    X(groups_hit) \
+    X(groups_miss) \
+    X(perm_denied) \
+    X(cred_switch) \
+    X(claim_avoided) \
+    X(mtime_publish) \
+    X(mtime_coalesced) \
+    X(fsync_flush) \
+    X(fsync_batched) \
+    X(workers_started) \
+    X(inval_inode) \
+    X(inval_entry) \
+    X(inval_failed) \
+    X(lncp_clone) \
+    X(lncp_kernel_bytes) \
+    X(lncp_buffer_bytes)
+
+enum upfs_stat {
+#define UPFS_STAT_ENUM(name) UPFS_STAT_ ## name,
+    UPFS_STATS(UPFS_STAT_ENUM)
+#undef UPFS_STAT_ENUM
+    UPFS_STAT_COUNT
+};
+
+extern uint64_t upfs_stats[UPFS_STAT_COUNT];
+
+#define UPFS_COUNT(name) UPFS_COUNT_N(name, 1)
+#define UPFS_COUNT_N(name, n) \
+    __atomic_add_fetch(&upfs_stats[UPFS_STAT_ ## name], (n), __ATOMIC_RELAXED)
+
+/* Latencies we keep a histogram of, in microseconds */
+#define UPFS_HISTS(X) \
+    X(fsync_us)
+
+enum upfs_hist {
+#define UPFS_HIST_ENUM(name) UPFS_HIST_ ## name,
+    UPFS_HISTS(UPFS_HIST_ENUM)
+#undef UPFS_HIST_ENUM
+    UPFS_HIST_COUNT
+};
+
+/* Buckets are powers of two, the last catching everything beyond */
+#define UPFS_HIST_BUCKETS 32
+
+extern uint64_t upfs_hists[UPFS_HIST_COUNT][UPFS_HIST_BUCKETS];
+
+#define UPFS_TIME(name, seconds) upfs_stats_time(UPFS_HIST_ ## name, (seconds))
+void upfs_stats_time(enum upfs_hist hist, double seconds);
+
+/* Count a request served by the calling worker thread */
+void upfs_stats_worker_request(void);
+
+/* Write out all the counters */
+void upfs_stats_dump(FILE *f);
+
+#endif
@@ -1,23 +1,47 @@
-#define _XOPEN_SOURCE 700 /* *at */
+#define _GNU_SOURCE /* *at, copy_file_range, fallocate */
 
 #include "upfs.h"
+#include "upfs-names.h"
+#include "upfs-stats.h"
 
-#define FUSE_USE_VERSION 28
-#include <fuse.h>
+#define FUSE_USE_VERSION 312
+#include <fuse_lowlevel.h>
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/fsuid.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+/* The request this thread is currently serving */
+static __thread fuse_req_t cur_req;
+
+const struct fuse_ctx *upfs_get_context(void)
+{
+    return fuse_req_ctx(cur_req);
+}
+
+/* Start serving a request on this thread */
+static void begin(fuse_req_t req)
+{
+    cur_req = req;
+    upfs_stats_worker_request();
+}
+
 #ifdef UPFS_PS
 
 /* Using permissions tables on the store */
@@ -27,17 +51,32 @@
 #define UPFS(func) upfs_ ## func
 
 #else
-/* Drop to caller privileges */
+/* The filesystem credentials this thread has switched to, so that switching
+ * to the ones it already has costs nothing. Root callers never switch. */
+static __thread uid_t cur_fsuid = 0;
+static __thread gid_t cur_fsgid = 0;
+
+/* Drop to caller privileges. setfsuid and setfsgid affect only the calling
+ * thread, so every worker can do this independently, so long as it regains
+ * before going back for another request. */
 static void drop(void)
 {
-    struct fuse_context *fctx = fuse_get_context();
-    if (setfsgid(fctx->gid) < 0) {
-        perror("setfsgid");
-        exit(1);
+    const struct fuse_ctx *fctx = upfs_get_context();
+    if (fctx->gid != cur_fsgid) {
+        if (setfsgid(fctx->gid) < 0) {
+            perror("setfsgid");
+            exit(1);
+        }
+        cur_fsgid = fctx->gid;
+        UPFS_COUNT(cred_switch);
     }
-    if (setfsuid(fctx->uid) < 0) {
-        perror("setfsuid");
-        exit(1);
+    if (fctx->uid != cur_fsuid) {
+        if (setfsuid(fctx->uid) < 0) {
+            perror("setfsuid");
+            exit(1);
+        }
+        cur_fsuid = fctx->uid;
+        UPFS_COUNT(cred_switch);
     }
 }
 
@@ -45,8 +84,16 @@ static void drop(void)
 static void regain(void)
 {
     int store_errno = errno;
-    setfsgid(0);
-    setfsuid(0);
+    if (cur_fsgid != 0) {
+        setfsgid(0);
+        cur_fsgid = 0;
+        UPFS_COUNT(cred_switch);
+    }
+    if (cur_fsuid != 0) {
+        setfsuid(0);
+        cur_fsuid = 0;
+        UPFS_COUNT(cred_switch);
+    }
     errno = store_errno;
 }
 
@@ -58,354 +105,2254 @@ static void regain(void)
 static char *perm_root_path = NULL, *store_root_path = NULL;
 int perm_root = -1, store_root = -1;
 
-/* Convert paths for the store */
-#ifdef UPFS_FATNAMES
-/* Convert paths for FAT support */
-static void store_path(char *store, const char *path)
-{
-    int o, i;
-    for (o = i = 0; path[i] && i < PATH_MAX - 1 && o < PATH_MAX - 1; i++) {
-        char c = path[i];
-        switch (c) {
-            case '"': case '?': case ':': case '*': case '|': case '<':
-            case '>':
-            case '$':
-            case '\\':
-                if (o + 4 >= PATH_MAX - 1)
-                    break;
-                store[o++] = '$';
-                snprintf(store+o, 3, "%02x", (int) (unsigned char) c);
-                o += 2;
-                break;
+/* Our mount options */
+static struct upfs_opts {
+    /* How long the kernel may cache our answers */
+    double entry_timeout, attr_timeout, negative_timeout;
+
+    /* Whether the kernel is checking permissions */
+    int default_permissions;
+
+    /* When to answer directory listings with attributes */
+    int readdirplus;
+
+    /* Whether to move file data with splice */
+    int splice;
 
-            default:
-#ifdef UPFS_FATLOWERCASE
-                if (c >= 'A' && c <= 'Z') {
-                    if (o + 4 >= PATH_MAX - 1)
-                        break;
-                    store[o++] = '$';
-                    snprintf(store+o, 3, "%02x", (int) (unsigned char) c);
-                    o += 2;
-                } else
+    /* Whether to give each worker thread its own queue */
+    int clone_fd;
+
+    /* Whether the kernel may cache writes and send them to us later */
+    int writeback_cache;
+
+    /* The largest writes we ask the kernel for */
+    unsigned int max_write;
+
+    /* How many directory nodes may hold open handles */
+    unsigned int dir_fds;
+
+    /* How long we remember that names don't exist */
+    double negative_cache;
+
+    /* How often to update the perm side's mtime while a file is written */
+    double mtime_interval;
+
+    /* How long we remember callers' supplementary groups */
+    double groups_cache;
+
+#ifndef UPFS_PS
+    /* Whether to answer access() from the perm side's attributes ourselves,
+     * rather than switching to the caller to ask the kernel */
+    int user_access;
 #endif
-                store[o++] = c;
-                break;
+
+#ifdef UPFS_PS
+    /* How many permissions table entries to keep in memory */
+    unsigned int table_cache;
+
+    /* Whether to journal changes to permissions tables, how long a journal
+     * may get, and how often they're folded back into their tables */
+    int journal;
+    unsigned int journal_size;
+    double journal_interval;
+
+    /* What percentage of a permissions table may be dead before it's
+     * compacted, and how fast compaction may write */
+    unsigned int compact, compact_rate;
+#endif
+
+    /* Where to write statistics on SIGUSR1 and unmount */
+    char *stats_file;
+} upfs_opts = {
+    .entry_timeout = -1,
+    .attr_timeout = 60.0,
+    .negative_timeout = -1,
+    .splice = 1,
+    .clone_fd = 1,
+    .max_write = 1024 * 1024,
+    .dir_fds = 512,
+    .negative_cache = 60.0,
+    .mtime_interval = 1.0,
+    .groups_cache = 1.0,
+#ifdef UPFS_PS
+    .table_cache = 65536,
+    .journal_size = 65536,
+    .journal_interval = 30.0,
+    .compact = 50,
+    .compact_rate = 1024 * 1024
+#endif
+};
+
+#define UPFS_OPT(templ, field) UPFS_OPT_VAL(templ, field, 0)
+#define UPFS_OPT_VAL(templ, field, value) \
+    { templ, offsetof(struct upfs_opts, field), value }
+enum {
+    UPFS_KEY_DEFAULT_PERMISSIONS
+};
+enum {
+    UPFS_READDIRPLUS_AUTO,
+    UPFS_READDIRPLUS_NO,
+    UPFS_READDIRPLUS_YES
+};
+
+static const struct fuse_opt upfs_opt_spec[] = {
+    UPFS_OPT("entry_timeout=%lf", entry_timeout),
+    UPFS_OPT("attr_timeout=%lf", attr_timeout),
+    UPFS_OPT("negative_timeout=%lf", negative_timeout),
+    UPFS_OPT("stats_file=%s", stats_file),
+    UPFS_OPT("dir_fds=%u", dir_fds),
+    UPFS_OPT("negative_cache=%lf", negative_cache),
+    UPFS_OPT("mtime_interval=%lf", mtime_interval),
+    UPFS_OPT("groups_cache=%lf", groups_cache),
+#ifndef UPFS_PS
+    UPFS_OPT_VAL("user_access", user_access, 1),
+#endif
+#ifdef UPFS_PS
+    UPFS_OPT("table_cache=%u", table_cache),
+    UPFS_OPT_VAL("journal", journal, 1),
+    UPFS_OPT_VAL("nojournal", journal, 0),
+    UPFS_OPT("journal_size=%u", journal_size),
+    UPFS_OPT("journal_interval=%lf", journal_interval),
+    UPFS_OPT("compact=%u", compact),
+    UPFS_OPT("compact_rate=%u", compact_rate),
+#endif
+    UPFS_OPT_VAL("splice", splice, 1),
+    UPFS_OPT_VAL("nosplice", splice, 0),
+    UPFS_OPT_VAL("noclone_fd", clone_fd, 0),
+    UPFS_OPT_VAL("writeback_cache", writeback_cache, 1),
+    UPFS_OPT_VAL("nowriteback_cache", writeback_cache, 0),
+    UPFS_OPT("max_write=%u", max_write),
+    UPFS_OPT_VAL("readdirplus=auto", readdirplus, UPFS_READDIRPLUS_AUTO),
+    UPFS_OPT_VAL("readdirplus=no", readdirplus, UPFS_READDIRPLUS_NO),
+    UPFS_OPT_VAL("readdirplus=yes", readdirplus, UPFS_READDIRPLUS_YES),
+    FUSE_OPT_KEY("default_permissions", UPFS_KEY_DEFAULT_PERMISSIONS),
+    FUSE_OPT_END
+};
+
+static int upfs_opt_proc(void *data, const char *arg, int key,
+    struct fuse_args *outargs)
+{
+    if (key == UPFS_KEY_DEFAULT_PERMISSIONS)
+        upfs_opts.default_permissions = 1;
+
+    /* Everything else is for FUSE */
+    return 1;
+}
+
+/****************************************************************
+ * INODE TABLE
+ ***************************************************************/
+
+/* An inode known to the kernel. As with paths before, a node is identified by
+ * its parent and the name it was looked up by. Directory nodes keep handles
+ * on their perm and store directories, so that operations within them only
+ * resolve the final component. Only the most recently used dir_fds nodes keep
+ * them; the rest reopen them from their parent when next needed. */
+struct upfs_node {
+    struct upfs_node *parent, *hash_next;
+    char *name, *pname, *sname;
+    int perm_fd, store_fd;
+    int hashed;
+
+    /* Kernel lookups plus child nodes */
+    uint64_t refs;
+
+    /* Locations using our handles, which may not be closed until they're
+     * done */
+    unsigned int pins;
+
+    /* Our place in the LRU list of nodes with open handles, and whether
+     * they've been used since we were listed or last passed over */
+    struct upfs_node *lru_prev, *lru_next;
+    int fd_used;
+
+    /* Names known not to exist in this directory, and the generation of that
+     * knowledge, bumped whenever names may have been created */
+    struct upfs_neg **neg;
+    unsigned int neg_count;
+    uint64_t neg_gen;
+
+    /* Files open on this node */
+    struct upfs_file *files;
+};
+
+/* Where an operation takes place: the perm and store directories, and the
+ * paths relative to them. The nodes owning the directory handles are pinned
+ * until loc_release. */
+struct upfs_loc {
+    struct upfs_node *dir, *perm_node;
+    int perm_dir, store_dir;
+    char name[NAME_MAX+1], ppath[PATH_MAX], spath[PATH_MAX];
+};
+
+/* The node table, protected by nodes_lock */
+static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct upfs_node root_node = {
+    .name = "", .pname = ".", .sname = ".",
+    .perm_fd = -1, .store_fd = -1,
+    .hashed = 1, .refs = 1
+};
+static struct upfs_node **node_buckets = NULL;
+static size_t node_bucket_count = 0, node_count = 0;
+
+/* Nodes with open handles, most recently listed first. The root isn't among
+ * them, as its handles are never closed. */
+static struct upfs_node *fd_lru_head = NULL, *fd_lru_tail = NULL;
+static size_t fd_lru_count = 0;
+
+static struct upfs_node *get_node(fuse_ino_t ino)
+{
+    if (ino == FUSE_ROOT_ID)
+        return &root_node;
+    return (struct upfs_node *) (uintptr_t) ino;
+}
+
+static fuse_ino_t node_ino(struct upfs_node *node)
+{
+    if (node == &root_node)
+        return FUSE_ROOT_ID;
+    return (uintptr_t) node;
+}
+
+static size_t node_hash(struct upfs_node *parent, const char *name)
+{
+    uint64_t h = 14695981039346656037ULL ^ (uintptr_t) parent;
+    for (; *name; name++) {
+        h ^= (unsigned char) *name;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Find the node for this name, if there is one. Nodes are hashed by their
+ * perm name, so that names for the same perm file share a chain. Called with
+ * nodes_lock held. */
+static struct upfs_node *node_find(struct upfs_node *parent, const char *name)
+{
+    struct upfs_node *node;
+    char pname[PATH_MAX];
+    if (!node_bucket_count)
+        return NULL;
+    upfs_perm_path(pname, name);
+    node = node_buckets[node_hash(parent, pname) % node_bucket_count];
+    for (; node; node = node->hash_next) {
+        if (node->parent == parent && !strcmp(node->name, name))
+            return node;
+    }
+    return NULL;
+}
+
+/* Add a node to the table. Called with nodes_lock held. */
+static int node_hash_in(struct upfs_node *node)
+{
+    size_t h;
+
+    if (node_count >= node_bucket_count) {
+        /* Grow the table */
+        size_t new_count = node_bucket_count ? node_bucket_count * 2 : 1024;
+        struct upfs_node **new_buckets, *cur, *next;
+        size_t i;
+
+        new_buckets = calloc(new_count, sizeof(struct upfs_node *));
+        if (!new_buckets)
+            return -1;
+        for (i = 0; i < node_bucket_count; i++) {
+            for (cur = node_buckets[i]; cur; cur = next) {
+                next = cur->hash_next;
+                h = node_hash(cur->parent, cur->pname) % new_count;
+                cur->hash_next = new_buckets[h];
+                new_buckets[h] = cur;
+            }
         }
+        free(node_buckets);
+        node_buckets = new_buckets;
+        node_bucket_count = new_count;
     }
-    store[o] = 0;
+
+    h = node_hash(node->parent, node->pname) % node_bucket_count;
+    node->hash_next = node_buckets[h];
+    node_buckets[h] = node;
+    node->hashed = 1;
+    node_count++;
+    return 0;
 }
-#else
-static void store_path(char *store, const char *path)
+
+/* Remove a node from the table, so that it can no longer be found by name.
+ * Called with nodes_lock held. */
+static void node_hash_out(struct upfs_node *node)
+{
+    struct upfs_node **link;
+
+    if (!node->hashed || node == &root_node)
+        return;
+
+    link = &node_buckets[node_hash(node->parent, node->pname) % node_bucket_count];
+    for (; *link; link = &(*link)->hash_next) {
+        if (*link == node) {
+            *link = node->hash_next;
+            break;
+        }
+    }
+    node->hash_next = NULL;
+    node->hashed = 0;
+    node_count--;
+}
+
+/* A name known not to exist on the perm side, the store side, or both */
+#define UPFS_NEG_PERM 1
+#define UPFS_NEG_STORE 2
+#define UPFS_NEG_BUCKETS 64
+#define UPFS_NEG_MAX 1024
+struct upfs_neg {
+    struct upfs_neg *next;
+    double expires;
+    int missing;
+    char name[];
+};
+
+static double now(void)
 {
-    strncpy(store, path, PATH_MAX - 1);
-    store[PATH_MAX-1] = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
-#endif
 
-/* Convert paths for our permissions directory */
-#ifdef UPFS_PERMLOWERCASE
-static void perm_path(char *perm, const char *path)
+/* Free a directory's negative entries. Called with nodes_lock held. */
+static void neg_free(struct upfs_node *dir)
 {
+    struct upfs_neg *neg, *next;
     int i;
-    for (i = 0; path[i] && i < PATH_MAX - 1; i++) {
-        char c = path[i];
-        if (c >= 'A' && c <= 'Z')
-            c += 'a' - 'A';
-        perm[i] = c;
+
+    if (!dir->neg)
+        return;
+    for (i = 0; i < UPFS_NEG_BUCKETS; i++) {
+        for (neg = dir->neg[i]; neg; neg = next) {
+            next = neg->next;
+            free(neg);
+        }
     }
-    perm[i] = 0;
+    free(dir->neg);
+    dir->neg = NULL;
+    dir->neg_count = 0;
 }
-#else
-static void perm_path(char *perm, const char *path)
+
+/* Names may have been created in this directory, so forget what we knew
+ * didn't exist. Called with nodes_lock held. */
+static void neg_clear(struct upfs_node *dir)
 {
-    strncpy(perm, path, PATH_MAX - 1);
-    perm[PATH_MAX-1] = 0;
+    neg_free(dir);
+    dir->neg_gen++;
 }
-#endif
 
-/* Correct incoming paths */
-static void correct_path(const char *path, char *ppath, char *spath)
+/* Find out where a name is known not to exist, and the generation of that
+ * knowledge. Called with nodes_lock held. */
+static int neg_find(struct upfs_node *dir, const char *name, uint64_t *gen)
 {
-    if (path[0] == '/') path++;
-    if (!path[0]) {
-        strcpy(spath, ".");
-        strcpy(ppath, ".");
-        return;
+    struct upfs_neg *neg;
+
+    *gen = dir->neg_gen;
+    if (!dir->neg)
+        return 0;
+    neg = dir->neg[node_hash(dir, name) % UPFS_NEG_BUCKETS];
+    for (; neg; neg = neg->next) {
+        if (!strcmp(neg->name, name))
+            return (neg->expires > now()) ? neg->missing : 0;
     }
-    store_path(spath, path);
-    perm_path(ppath, path);
+    return 0;
 }
 
-/* Attempt to make the directory component of this path */
-static void mkdir_p(const char *path)
+/* Remember where a name was found not to exist, if nothing has been created
+ * in the directory since we looked. Called with nodes_lock held. */
+static void neg_add(struct upfs_node *dir, const char *name, uint64_t gen,
+    int missing)
 {
-    char buf[PATH_MAX], *slash;
+    struct upfs_neg **link, *neg;
+    double t = now();
 
-    strncpy(buf, path, PATH_MAX);
-    buf[PATH_MAX-1] = 0;
+    if (gen != dir->neg_gen || upfs_opts.negative_cache <= 0)
+        return;
 
-    /* Make each component (except the last) in turn */
-    slash = buf - 1;
-    while ((slash = strchr(slash + 1, '/'))) {
-        *slash = 0;
-        UPFS(mkdirat)(perm_root, buf, 0777);
-        *slash = '/';
+    if (dir->neg) {
+        link = &dir->neg[node_hash(dir, name) % UPFS_NEG_BUCKETS];
+        for (; *link; link = &(*link)->next) {
+            neg = *link;
+            if (strcmp(neg->name, name))
+                continue;
+            if (neg->expires > t) {
+                neg->missing |= missing;
+            } else if (missing) {
+                neg->missing = missing;
+                neg->expires = t + upfs_opts.negative_cache;
+            } else {
+                *link = neg->next;
+                free(neg);
+                dir->neg_count--;
+            }
+            return;
+        }
+    }
+    if (!missing)
+        return;
+
+    /* A new name. If the directory has too many, start over. */
+    if (dir->neg_count >= UPFS_NEG_MAX)
+        neg_free(dir);
+    if (!dir->neg) {
+        dir->neg = calloc(UPFS_NEG_BUCKETS, sizeof(struct upfs_neg *));
+        if (!dir->neg)
+            return;
     }
+    neg = malloc(sizeof(struct upfs_neg) + strlen(name) + 1);
+    if (!neg)
+        return;
+    strcpy(neg->name, name);
+    neg->missing = missing;
+    neg->expires = t + upfs_opts.negative_cache;
+    link = &dir->neg[node_hash(dir, name) % UPFS_NEG_BUCKETS];
+    neg->next = *link;
+    *link = neg;
+    dir->neg_count++;
 }
 
-/* Attempt to make a full file to represent one in the store */
-static void mkfull(const char *path, struct stat *sbuf)
+/* Close a node's directory handles. Called with nodes_lock held. */
+static void node_close_fds(struct upfs_node *node)
 {
-    mkdir_p(path);
-    if (S_ISDIR(sbuf->st_mode))
-        UPFS(mkdirat)(perm_root, path, 0777);
+    if (node == &root_node || (node->perm_fd < 0 && node->store_fd < 0))
+        return;
+
+    if (node->perm_fd >= 0 && node->perm_fd != node->store_fd)
+        close(node->perm_fd);
+    if (node->store_fd >= 0)
+        close(node->store_fd);
+    node->perm_fd = node->store_fd = -1;
+
+    if (node->lru_prev)
+        node->lru_prev->lru_next = node->lru_next;
+    else
+        fd_lru_head = node->lru_next;
+    if (node->lru_next)
+        node->lru_next->lru_prev = node->lru_prev;
     else
-        UPFS(mknodat)(perm_root, path, 0666, 0);
+        fd_lru_tail = node->lru_prev;
+    node->lru_prev = node->lru_next = NULL;
+    node->fd_used = 0;
+    fd_lru_count--;
 }
 
-static int upfs_stat(int perm_dirfd, int store_dirfd, const char *path, const char *spath, struct stat *sbuf)
+/* List a node first among those with open handles */
+static void node_lru_push(struct upfs_node *node)
 {
-    int ret, store_ret;
-    struct stat store_buf;
+    node->lru_prev = NULL;
+    node->lru_next = fd_lru_head;
+    if (fd_lru_head)
+        fd_lru_head->lru_prev = node;
+    fd_lru_head = node;
+    if (!fd_lru_tail)
+        fd_lru_tail = node;
+}
 
-    drop();
-    ret = UPFS(fstatat)(perm_dirfd, path, sbuf, AT_SYMLINK_NOFOLLOW);
-    regain();
-    if (ret >= 0) {
-        if (S_ISLNK(sbuf->st_mode)) {
-            /* Links don't need a backing file, to support inter-case links */
-            return ret;
-        }
+/* Mark a node's handles as just used, and if that's made too many nodes have
+ * handles open, close the least recently used. Using handles a node already
+ * has only marks the node itself, rather than moving it in the list, so that
+ * the hot path writes nothing shared; a node marked since it was listed is
+ * moved back to the front when it's next considered for closing instead.
+ * Called with nodes_lock held. */
+static void node_touch_fds(struct upfs_node *node)
+{
+    struct upfs_node *victim, *prev;
 
-        store_ret = fstatat(store_dirfd, spath, &store_buf, 0);
-        if (store_ret < 0) return -errno;
-        if (S_ISREG(sbuf->st_mode)) {
-            sbuf->st_size = store_buf.st_size;
-            sbuf->st_blksize = store_buf.st_blksize;
-            sbuf->st_blocks = store_buf.st_blocks;
+    if (node == &root_node)
+        return;
+
+    if (node->lru_prev || node == fd_lru_head) {
+        if (!node->fd_used)
+            node->fd_used = 1;
+        return;
+    }
+
+    /* Newly opened */
+    node_lru_push(node);
+    fd_lru_count++;
+
+    for (victim = fd_lru_tail;
+         fd_lru_count > upfs_opts.dir_fds && victim && victim != node;
+         victim = prev) {
+        prev = victim->lru_prev;
+        if (victim->pins)
+            continue;
+        if (victim->fd_used) {
+            /* Used since it was listed, so give it another chance */
+            victim->fd_used = 0;
+            if (victim->lru_prev)
+                victim->lru_prev->lru_next = victim->lru_next;
+            else
+                fd_lru_head = victim->lru_next;
+            if (victim->lru_next)
+                victim->lru_next->lru_prev = victim->lru_prev;
+            else
+                fd_lru_tail = victim->lru_prev;
+            node_lru_push(victim);
+            continue;
         }
-        return ret;
+        node_close_fds(victim);
+        UPFS_COUNT(dir_fd_evict);
     }
-    if (errno != ENOENT) return -errno;
+}
 
-    ret = fstatat(store_dirfd, spath, sbuf, 0);
-    if (ret >= 0) return ret;
-    return -errno;
+/* Drop references to a node, freeing it if unused. Called with nodes_lock
+ * held. */
+static void node_unref(struct upfs_node *node, uint64_t count)
+{
+    struct upfs_node *parent;
+
+    while (node && node != &root_node) {
+        node->refs -= count;
+        if (node->refs)
+            return;
+
+        node_hash_out(node);
+        node_close_fds(node);
+        neg_free(node);
+        parent = node->parent;
+        free(node->name);
+        free(node->pname);
+        free(node->sname);
+        free(node);
+
+        /* It was holding a reference to its parent */
+        node = parent;
+        count = 1;
+    }
 }
 
-static int upfs_getattr(const char *path, struct stat *sbuf)
+/* Set the names of a node */
+static int node_set_name(struct upfs_node *node, const char *name)
 {
     char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
-    return upfs_stat(perm_root, store_root, ppath, spath, sbuf);
+    char *new_name, *new_pname, *new_sname;
+
+    upfs_perm_path(ppath, name);
+    upfs_store_path(spath, name);
+    new_name = strdup(name);
+    new_pname = strdup(ppath);
+    new_sname = strdup(spath);
+    if (!new_name || !new_pname || !new_sname) {
+        free(new_name);
+        free(new_pname);
+        free(new_sname);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    free(node->name);
+    free(node->pname);
+    free(node->sname);
+    node->name = new_name;
+    node->pname = new_pname;
+    node->sname = new_sname;
+    return 0;
 }
 
-static int upfs_readlink(const char *path, char *buf, size_t buf_sz)
+/* Get the node for this name, creating it if needed, and add a reference.
+ * Called with nodes_lock held. */
+static struct upfs_node *node_get(struct upfs_node *parent, const char *name)
 {
-    ssize_t ret;
-    struct stat sbuf;
-    char ppath[PATH_MAX], spath[PATH_MAX];
+    struct upfs_node *node;
+
+    node = node_find(parent, name);
+    if (node) {
+        node->refs++;
+        return node;
+    }
+
+    node = calloc(1, sizeof(struct upfs_node));
+    if (!node)
+        return NULL;
+    node->perm_fd = node->store_fd = -1;
+    if (node_set_name(node, name) < 0) {
+        free(node);
+        return NULL;
+    }
+    node->parent = parent;
+    if (node_hash_in(node) < 0) {
+        free(node->name);
+        free(node->pname);
+        free(node->sname);
+        free(node);
+        errno = ENOMEM;
+        return NULL;
+    }
+    parent->refs++;
+    node->refs = 1;
+    return node;
+}
+
+/* Get a directory node's handle on the store (or perm) directory, opening it
+ * if we haven't yet. Perm directories known not to exist aren't looked for
+ * again, as in unclaimed trees every operation would otherwise look for each
+ * of them on the way to the nearest which does. Called with nodes_lock held,
+ * which is let go while opening, so the caller must hold a reference to the
+ * node. */
+static int node_fd(struct upfs_node *node, int store)
+{
+    struct upfs_node *parent;
+    int *fdp, dir_fd, fd, save_errno;
+    uint64_t neg_gen = 0;
+    char name[PATH_MAX];
+
 #ifdef UPFS_PS
-    int fd;
+    /* The permissions are in the store */
+    store = 1;
 #endif
-    correct_path(path, ppath, spath);
 
-#ifdef UPFS_PS
-    /* We store the link target in the store file, so just check that it claims
-     * to be a link */
-    ret = UPFS(fstatat)(perm_root, ppath, &sbuf, 0);
-    if (ret < 0) return -errno;
-    if (!S_ISLNK(sbuf.st_mode))
-        return -EINVAL;
+    fdp = store ? &node->store_fd : &node->perm_fd;
 
-    /* Then read it */
-    fd = openat(store_root, spath, O_RDONLY);
-    if (fd < 0) return -errno;
-    ret = read(fd, buf, buf_sz-1);
-    if (ret < 0) {
-        int save_errno = errno;
-        close(fd);
+again:
+    if (*fdp >= 0) {
+        UPFS_COUNT(dir_fd_hit);
+        node_touch_fds(node);
+        return *fdp;
+    }
+    if (!node->parent) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (!store &&
+        (neg_find(node->parent, node->name, &neg_gen) & UPFS_NEG_PERM)) {
+        UPFS_COUNT(neg_perm_dir_hit);
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Open it from the parent's handle, but don't make every other thread
+     * wait on the filesystem while we do. The parent is held and pinned
+     * meanwhile, so that its handle stays open. */
+    parent = node->parent;
+    parent->refs++;
+    dir_fd = node_fd(parent, store);
+    if (dir_fd < 0) {
+        save_errno = errno;
+        node_unref(parent, 1);
+        errno = save_errno;
+        return -1;
+    }
+    parent->pins++;
+    strcpy(name, store ? node->sname : node->pname);
+    UPFS_COUNT(dir_fd_miss);
+
+    pthread_mutex_unlock(&nodes_lock);
+    fd = openat(dir_fd, name, O_RDONLY|O_DIRECTORY);
+    save_errno = errno;
+    pthread_mutex_lock(&nodes_lock);
+
+    if (*fdp >= 0) {
+        /* Another thread opened it first, so use theirs */
+        if (fd >= 0)
+            close(fd);
+        fd = *fdp;
+        node_touch_fds(node);
+
+    } else if (fd < 0 && save_errno == ENOENT &&
+        (node->parent != parent ||
+         strcmp(name, store ? node->sname : node->pname))) {
+        /* It was renamed as we looked */
+        parent->pins--;
+        node_unref(parent, 1);
+        goto again;
+
+    } else if (fd < 0) {
+        if (!store && save_errno == ENOENT)
+            neg_add(parent, node->name, neg_gen, UPFS_NEG_PERM);
+
+    } else {
+        *fdp = fd;
+        node_touch_fds(node);
+
+    }
+
+    parent->pins--;
+    node_unref(parent, 1);
+    errno = save_errno;
+    return fd;
+}
+
+/* Locate a name within a directory node. Called with nodes_lock held. */
+static int loc_locked(struct upfs_node *dir, const char *name,
+    struct upfs_loc *loc)
+{
+    int save_errno;
+
+    loc->dir = loc->perm_node = NULL;
+    loc->name[0] = 0;
+
+    if (!dir) {
+        /* The root itself */
+        loc->perm_dir = perm_root;
+        loc->store_dir = store_root;
+        strcpy(loc->ppath, ".");
+        strcpy(loc->spath, ".");
+        return 0;
+    }
+
+    /* node_fd lets go of nodes_lock, after which name and dir may belong to
+     * a node which has been renamed, so keep our own */
+    strncpy(loc->name, name, NAME_MAX);
+    loc->name[NAME_MAX] = 0;
+    loc->dir = dir;
+    dir->refs++;
+    dir->pins++;
+
+    loc->store_dir = node_fd(dir, 1);
+    if (loc->store_dir < 0) {
+        save_errno = errno;
+        dir->pins--;
+        node_unref(dir, 1);
+        loc->dir = NULL;
         return -save_errno;
     }
-    close(fd);
-    buf[ret] = 0;
-    return 0;
+    upfs_store_path(loc->spath, loc->name);
+
+#ifdef UPFS_PS
+    loc->perm_dir = loc->store_dir;
+    upfs_perm_path(loc->ppath, loc->name);
 
 #else
-    /* The link is stored as a link in the permissions directory */
-    drop();
-    ret = UPFS(readlinkat)(perm_root, ppath, buf, buf_sz-1);
-    regain();
-    if (ret < 0) return -errno;
-    buf[ret] = 0;
+    {
+        /* The directory may not exist on the perm side, in which case the path
+         * is relative to the nearest ancestor which does. Each is held while
+         * we look, as it may otherwise be renamed away and freed. */
+        struct upfs_node *pdir, *next;
+        char *path_start = loc->ppath + PATH_MAX - 1;
+        char pname[PATH_MAX];
+        size_t len;
+
+        *path_start = 0;
+        upfs_perm_path(pname, loc->name);
+        pdir = dir;
+        pdir->refs++;
+        while (1) {
+            len = strlen(pname);
+            if (len + 1 > (size_t) (path_start - loc->ppath)) {
+                loc->perm_dir = -1;
+                errno = ENAMETOOLONG;
+                break;
+            }
+            if (*path_start)
+                *--path_start = '/';
+            path_start -= len;
+            memcpy(path_start, pname, len);
+
+            loc->perm_dir = node_fd(pdir, 0);
+            if (loc->perm_dir >= 0 || errno != ENOENT)
+                break;
+            strcpy(pname, pdir->pname);
+            next = pdir->parent;
+            next->refs++;
+            node_unref(pdir, 1);
+            pdir = next;
+        }
+        if (loc->perm_dir < 0) {
+            save_errno = errno;
+            node_unref(pdir, 1);
+            dir->pins--;
+            node_unref(dir, 1);
+            loc->dir = NULL;
+            return -save_errno;
+        }
+        memmove(loc->ppath, path_start, strlen(path_start) + 1);
+        loc->perm_node = pdir;
+        pdir->pins++;
+    }
 
-#if 0
-    FIXME: For now, allow links with no backing file
-    ret = fstatat(store_root, spath, &sbuf, 0);
-    if (ret < 0) return -errno;
 #endif
+
     return 0;
+}
 
-#endif
+/* Locate a name within a directory node */
+static int child_loc(struct upfs_node *dir, const char *name,
+    struct upfs_loc *loc)
+{
+    int ret;
+    pthread_mutex_lock(&nodes_lock);
+    ret = loc_locked(dir, name, loc);
+    pthread_mutex_unlock(&nodes_lock);
+    return ret;
 }
 
-static int upfs_mknod(const char *path, mode_t mode, dev_t dev)
+/* Locate a node */
+static int node_loc(struct upfs_node *node, struct upfs_loc *loc)
 {
     int ret;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
+    pthread_mutex_lock(&nodes_lock);
+    if (node == &root_node)
+        ret = loc_locked(NULL, NULL, loc);
+    else
+        ret = loc_locked(node->parent, node->name, loc);
+    pthread_mutex_unlock(&nodes_lock);
+    return ret;
+}
 
-    /* Create the full thing on the perms fs */
-    drop();
-    ret = UPFS(mknodat)(perm_root, ppath, mode, dev);
-    regain();
-    if (ret < 0) return -errno;
+/* Release the nodes pinned by a location */
+static void loc_release(struct upfs_loc *loc)
+{
+    pthread_mutex_lock(&nodes_lock);
+    if (loc->dir) {
+        loc->dir->pins--;
+        node_unref(loc->dir, 1);
+    }
+    if (loc->perm_node) {
+        loc->perm_node->pins--;
+        node_unref(loc->perm_node, 1);
+    }
+    pthread_mutex_unlock(&nodes_lock);
+}
 
-    /* Then create an empty file to represent it on the store */
-    ret = mknodat(store_root, spath, S_IFREG|0600, 0);
-    if (ret < 0) return -errno;
-    return 0;
+/* Detach a node whose name is gone. Its handles are on a removed directory,
+ * so close them now rather than waiting for them to age out. Called with
+ * nodes_lock held. */
+static void node_detach(struct upfs_node *node)
+{
+    node_hash_out(node);
+    if (!node->pins)
+        node_close_fds(node);
+}
+
+/* A name has been removed, so forget its node */
+static void node_remove(struct upfs_node *dir, const char *name)
+{
+    struct upfs_node *node;
+    pthread_mutex_lock(&nodes_lock);
+    node = node_find(dir, name);
+    if (node)
+        node_detach(node);
+    pthread_mutex_unlock(&nodes_lock);
+}
+
+/* A name has been renamed, so move its node */
+static void node_move(struct upfs_node *dir, const char *name,
+    struct upfs_node *new_dir, const char *new_name)
+{
+    struct upfs_node *node, *old;
+
+    pthread_mutex_lock(&nodes_lock);
+
+    /* Whatever was at the target is gone */
+    old = node_find(new_dir, new_name);
+    if (old)
+        node_detach(old);
+
+    node = node_find(dir, name);
+    if (node) {
+        node_hash_out(node);
+        if (node_set_name(node, new_name) < 0) {
+            /* Leave it unhashed. The kernel will look it up again. */
+            pthread_mutex_unlock(&nodes_lock);
+            return;
+        }
+        if (new_dir != dir) {
+            new_dir->refs++;
+            node_unref(dir, 1);
+            node->parent = new_dir;
+        }
+        node_hash_in(node);
+    }
+
+    pthread_mutex_unlock(&nodes_lock);
 }
 
-static int upfs_mkdir(const char *path, mode_t mode)
-{
-    int ret;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
+/****************************************************************
+ * KERNEL CACHE INVALIDATION
+ ***************************************************************/
+
+/* The kernel may hold locks that a notification needs while it waits for the
+ * operation which caused it, so invalidations are queued and sent from a
+ * thread of their own */
+struct upfs_inval {
+    struct upfs_inval *next;
+    fuse_ino_t ino;
+    char name[];
+};
+
+static struct fuse_session *upfs_session = NULL;
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static struct upfs_inval *inval_head = NULL, **inval_tail = &inval_head;
+static int inval_running = 0;
+
+/* Queue the invalidation of a name in a directory, or of an inode's
+ * attributes if name is NULL */
+static void inval_queue(fuse_ino_t ino, const char *name)
+{
+    size_t len = name ? strlen(name) : 0;
+    struct upfs_inval *inv;
+
+    if (!inval_running)
+        return;
+
+    inv = malloc(sizeof(struct upfs_inval) + len + 1);
+    if (!inv) {
+        UPFS_COUNT(inval_failed);
+        return;
+    }
+    inv->next = NULL;
+    inv->ino = ino;
+    memcpy(inv->name, name ? name : "", len + 1);
+
+    pthread_mutex_lock(&inval_lock);
+    *inval_tail = inv;
+    inval_tail = &inv->next;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+}
+
+static void *inval_thread(void *ignore)
+{
+    struct upfs_inval *inv, *next;
+    int ret;
+
+    pthread_mutex_lock(&inval_lock);
+    while (inval_running || inval_head) {
+        if (!inval_head) {
+            pthread_cond_wait(&inval_cond, &inval_lock);
+            continue;
+        }
+        inv = inval_head;
+        inval_head = NULL;
+        inval_tail = &inval_head;
+        pthread_mutex_unlock(&inval_lock);
+
+        for (; inv; inv = next) {
+            next = inv->next;
+            if (inv->name[0]) {
+                ret = fuse_lowlevel_notify_inval_entry(upfs_session, inv->ino,
+                    inv->name, strlen(inv->name));
+                UPFS_COUNT(inval_entry);
+            } else {
+                ret = fuse_lowlevel_notify_inval_inode(upfs_session, inv->ino,
+                    -1, 0);
+                UPFS_COUNT(inval_inode);
+            }
+
+            /* ENOENT just means the kernel had nothing cached */
+            if (ret < 0 && ret != -ENOENT)
+                UPFS_COUNT(inval_failed);
+            free(inv);
+        }
+
+        pthread_mutex_lock(&inval_lock);
+    }
+    pthread_mutex_unlock(&inval_lock);
+
+    return NULL;
+}
+
+/* Invalidate the kernel's view of the other names for this perm file, i.e.,
+ * those differing only in case. If the file is gone, their entries are
+ * invalidated, otherwise just their attributes. */
+static void loc_inval_aliases(struct upfs_loc *loc, int gone)
+{
+    struct upfs_node *node;
+    const char *pname;
+
+    if (!loc->dir)
+        return;
+
+    /* The last component of ppath is this name's perm name */
+    pname = strrchr(loc->ppath, '/');
+    pname = pname ? pname + 1 : loc->ppath;
+
+    pthread_mutex_lock(&nodes_lock);
+    if (node_bucket_count) {
+        node = node_buckets[node_hash(loc->dir, pname) % node_bucket_count];
+        for (; node; node = node->hash_next) {
+            if (node->parent != loc->dir || strcmp(node->pname, pname) ||
+                !strcmp(node->name, loc->name))
+                continue;
+            if (gone)
+                inval_queue(node_ino(loc->dir), node->name);
+            else
+                inval_queue(node_ino(node), NULL);
+        }
+    }
+    pthread_mutex_unlock(&nodes_lock);
+}
+
+/* Directories have been created on the perm side for this location, so their
+ * ownership and mode no longer reflect the store */
+static void loc_inval_claimed(struct upfs_loc *loc)
+{
+#ifndef UPFS_PS
+    struct upfs_node *dir;
+
+    pthread_mutex_lock(&nodes_lock);
+    for (dir = loc->dir; dir && dir != loc->perm_node; dir = dir->parent)
+        inval_queue(node_ino(dir), NULL);
+    pthread_mutex_unlock(&nodes_lock);
+#endif
+}
+
+/* Names may have been created at this location, including directories on the
+ * perm side leading to it */
+static void loc_neg_clear(struct upfs_loc *loc)
+{
+    struct upfs_node *dir;
+
+    pthread_mutex_lock(&nodes_lock);
+    for (dir = loc->dir; dir; dir = dir->parent) {
+        neg_clear(dir);
+        if (dir == loc->perm_node)
+            break;
+    }
+    pthread_mutex_unlock(&nodes_lock);
+}
+
+/****************************************************************
+ * FILE SYSTEM OPERATIONS
+ ***************************************************************/
+
+/* An open file */
+struct upfs_file {
+    int perm_fd, store_fd;
+    int flags;
+    int special;
+
+    /* The node we're open on, and the other files open on it, protected by
+     * nodes_lock */
+    struct upfs_node *node;
+    struct upfs_file *node_next, **node_prev;
+
+    /* The time of our last write, if the perm side doesn't have it yet, and
+     * when we last gave it one. publish_lock is held while giving it one, so
+     * they arrive in order, and is taken before mtime_lock or nodes_lock. */
+    pthread_mutex_t publish_lock, mtime_lock;
+    int mtime_dirty;
+    struct timespec mtime;
+    double mtime_published;
+};
+
+static struct upfs_file *get_file(struct fuse_file_info *ffi)
+{
+    return (struct upfs_file *) (uintptr_t) ffi->fh;
+}
+
+/* Make a new file */
+static struct upfs_file *file_new(int flags)
+{
+    struct upfs_file *file;
+
+    file = calloc(1, sizeof(struct upfs_file));
+    if (!file)
+        return NULL;
+    file->perm_fd = file->store_fd = -1;
+    file->flags = flags;
+    pthread_mutex_init(&file->publish_lock, NULL);
+    pthread_mutex_init(&file->mtime_lock, NULL);
+    return file;
+}
+
+/* Note that a file is open on a node */
+static void file_attach(struct upfs_file *file, fuse_ino_t ino)
+{
+    struct upfs_node *node = get_node(ino);
+
+    pthread_mutex_lock(&nodes_lock);
+    file->node = node;
+    file->node_next = node->files;
+    file->node_prev = &node->files;
+    if (node->files)
+        node->files->node_prev = &file->node_next;
+    node->files = file;
+    pthread_mutex_unlock(&nodes_lock);
+}
+
+/* Close a file, and free it */
+static void file_free(struct upfs_file *file)
+{
+    if (!file)
+        return;
+    if (file->node) {
+        pthread_mutex_lock(&nodes_lock);
+        *file->node_prev = file->node_next;
+        if (file->node_next)
+            file->node_next->node_prev = file->node_prev;
+        pthread_mutex_unlock(&nodes_lock);
+    }
+
+    if (file->perm_fd >= 0) close(file->perm_fd);
+    if (file->store_fd >= 0) close(file->store_fd);
+    pthread_mutex_destroy(&file->publish_lock);
+    pthread_mutex_destroy(&file->mtime_lock);
+    free(file);
+}
+
+/* Give the perm side the time of our last write */
+static int file_publish_mtime(struct upfs_file *file)
+{
+    struct timespec times[2];
+    int dirty, ret = 0;
+
+    pthread_mutex_lock(&file->publish_lock);
+    pthread_mutex_lock(&file->mtime_lock);
+    dirty = file->mtime_dirty;
+    times[0] = times[1] = file->mtime;
+    pthread_mutex_unlock(&file->mtime_lock);
+
+    if (dirty) {
+#ifdef UPFS_PS
+        /* The table may have been rewritten since we opened it, so go by
+         * name */
+        struct upfs_loc loc;
+        ret = node_loc(file->node, &loc);
+        if (!ret) {
+            if (UPFS(utimensat)(loc.perm_dir, loc.ppath, times, 0) < 0)
+                ret = -errno;
+            loc_release(&loc);
+        }
+#else
+        if (UPFS(futimens)(file->perm_fd, times) < 0)
+            ret = -errno;
+#endif
+        UPFS_COUNT(mtime_publish);
+
+        /* Unless it's been written again since */
+        pthread_mutex_lock(&file->mtime_lock);
+        if (file->mtime.tv_sec == times[1].tv_sec &&
+            file->mtime.tv_nsec == times[1].tv_nsec)
+            file->mtime_dirty = 0;
+        pthread_mutex_unlock(&file->mtime_lock);
+    }
+
+    pthread_mutex_unlock(&file->publish_lock);
+    return ret;
+}
+
+/* The file has been written. Rather than updating the perm side every time,
+ * remember when, and pass it on at most every mtime_interval seconds. */
+static void file_touch(struct upfs_file *file)
+{
+    struct timespec ts;
+    double t = now();
+    int due;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    pthread_mutex_lock(&file->mtime_lock);
+    file->mtime = ts;
+    file->mtime_dirty = 1;
+    due = (t - file->mtime_published >= upfs_opts.mtime_interval);
+    if (due)
+        file->mtime_published = t;
+    else
+        UPFS_COUNT(mtime_coalesced);
+    pthread_mutex_unlock(&file->mtime_lock);
+
+    if (due)
+        file_publish_mtime(file);
+}
+
+/* Report the latest write to any file open on this node, which the perm side
+ * may not have yet */
+static void node_mtime(struct upfs_node *node, struct stat *sbuf)
+{
+    struct upfs_file *file;
+
+    pthread_mutex_lock(&nodes_lock);
+    for (file = node->files; file; file = file->node_next) {
+        pthread_mutex_lock(&file->mtime_lock);
+        if (file->mtime_dirty &&
+            (file->mtime.tv_sec > sbuf->st_mtim.tv_sec ||
+             (file->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+              file->mtime.tv_nsec > sbuf->st_mtim.tv_nsec))) {
+            sbuf->st_mtim = sbuf->st_ctim = file->mtime;
+        }
+        pthread_mutex_unlock(&file->mtime_lock);
+    }
+    pthread_mutex_unlock(&nodes_lock);
+}
+
+/* A caller waiting for a sync to cover its request, and how that went */
+struct upfs_sync_wait {
+    struct upfs_sync_wait *next;
+    uint64_t seq;
+    int done, error;
+};
+
+/* A file being synced. Everyone who asks while a sync is running waits for
+ * the next one, which covers them all. */
+struct upfs_sync {
+    struct upfs_sync *next;
+    dev_t dev;
+    ino_t ino;
+    unsigned int users;
+
+    /* Requests so far, the last covered by a sync, and the last needing a
+     * full fsync */
+    uint64_t seq, done, full;
+    int running;
+
+    /* Callers whose requests no sync has covered yet. Each is told the
+     * result of the sync which does, and only that one. */
+    struct upfs_sync_wait *waits;
+    pthread_cond_t cond;
+};
+
+/* Files being synced, protected by syncs_lock */
+static pthread_mutex_t syncs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct upfs_sync *syncs = NULL;
+
+/* fsync or fdatasync a file, sharing the flush with concurrent callers */
+static int group_sync(int fd, int datasync)
+{
+    struct stat sbuf;
+    struct upfs_sync *s, **sp;
+    struct upfs_sync_wait me, *w, **wp;
+    uint64_t run;
+    int full, ret, sync_errno, led = 0;
+
+    if (fstat(fd, &sbuf) < 0)
+        return -errno;
+
+    pthread_mutex_lock(&syncs_lock);
+    for (s = syncs; s; s = s->next) {
+        if (s->dev == sbuf.st_dev && s->ino == sbuf.st_ino)
+            break;
+    }
+    if (!s) {
+        s = calloc(1, sizeof(struct upfs_sync));
+        if (!s) {
+            pthread_mutex_unlock(&syncs_lock);
+            ret = datasync ? fdatasync(fd) : fsync(fd);
+            return (ret < 0) ? -errno : 0;
+        }
+        s->dev = sbuf.st_dev;
+        s->ino = sbuf.st_ino;
+        pthread_cond_init(&s->cond, NULL);
+        s->next = syncs;
+        syncs = s;
+    }
+    s->users++;
+    me.seq = ++s->seq;
+    me.done = me.error = 0;
+    me.next = s->waits;
+    s->waits = &me;
+    if (!datasync)
+        s->full = me.seq;
+
+    while (!me.done) {
+        if (s->running) {
+            pthread_cond_wait(&s->cond, &syncs_lock);
+            continue;
+        }
+
+        /* Our turn, for everyone waiting */
+        s->running = 1;
+        run = s->seq;
+        full = s->full > s->done;
+        pthread_mutex_unlock(&syncs_lock);
+        ret = full ? fsync(fd) : fdatasync(fd);
+        sync_errno = (ret < 0) ? errno : 0;
+        pthread_mutex_lock(&syncs_lock);
+
+        /* Tell those it covered how it went */
+        for (wp = &s->waits; *wp; ) {
+            w = *wp;
+            if (w->seq <= run) {
+                w->done = 1;
+                w->error = sync_errno;
+                *wp = w->next;
+            } else {
+                wp = &w->next;
+            }
+        }
+        s->done = run;
+        s->running = 0;
+        led = 1;
+        UPFS_COUNT(fsync_flush);
+        pthread_cond_broadcast(&s->cond);
+    }
+    if (!led)
+        UPFS_COUNT(fsync_batched);
+
+    ret = -me.error;
+    if (!--s->users) {
+        for (sp = &syncs; *sp != s; sp = &(*sp)->next);
+        *sp = s->next;
+        pthread_cond_destroy(&s->cond);
+        free(s);
+    }
+    pthread_mutex_unlock(&syncs_lock);
+    return ret;
+}
+
+/* The mtime has been set explicitly, so forget any writes before it */
+static void node_forget_mtime(struct upfs_node *node)
+{
+    struct upfs_file *file;
+
+    pthread_mutex_lock(&nodes_lock);
+    for (file = node->files; file; file = file->node_next) {
+        pthread_mutex_lock(&file->mtime_lock);
+        file->mtime_dirty = 0;
+        pthread_mutex_unlock(&file->mtime_lock);
+    }
+    pthread_mutex_unlock(&nodes_lock);
+}
+
+/* An open directory */
+struct upfs_dir {
+    DIR *dh;
+    int perm_fd, store_fd;
+
+#ifdef UPFS_PS
+    /* The directory's permissions table, read once for the whole listing */
+    struct upfs_table *table;
+#endif
+
+    /* Where we are, and the entry there if we've read it but the kernel
+     * hasn't */
+    off_t offset;
+    struct dirent *entry;
+};
+
+static struct upfs_dir *get_dir(struct fuse_file_info *ffi)
+{
+    return (struct upfs_dir *) (uintptr_t) ffi->fh;
+}
+
+/* Attempt to make the directory component of this path */
+static void mkdir_p(struct upfs_loc *loc)
+{
+    char buf[PATH_MAX], *slash;
+
+    strncpy(buf, loc->ppath, PATH_MAX);
+    buf[PATH_MAX-1] = 0;
+
+    /* Make each component (except the last) in turn */
+    slash = buf - 1;
+    while ((slash = strchr(slash + 1, '/'))) {
+        *slash = 0;
+        UPFS(mkdirat)(loc->perm_dir, buf, 0777);
+        *slash = '/';
+    }
+
+    if (strchr(loc->ppath, '/')) {
+        loc_inval_claimed(loc);
+        loc_neg_clear(loc);
+    }
+}
+
+/* Attempt to make a full file to represent one in the store */
+static void mkfull(struct upfs_loc *loc, struct stat *sbuf)
+{
+    mkdir_p(loc);
+    if (S_ISDIR(sbuf->st_mode))
+        UPFS(mkdirat)(loc->perm_dir, loc->ppath, 0777);
+    else
+        UPFS(mknodat)(loc->perm_dir, loc->ppath, 0666, 0);
+    loc_neg_clear(loc);
+}
+
+/* Fill in what the store knows about something the perm side has */
+static int upfs_stat_store(int store_dirfd, const char *spath, struct stat *sbuf)
+{
+    struct stat store_buf;
+
+    if (S_ISLNK(sbuf->st_mode)) {
+        /* Links don't need a backing file, to support inter-case links */
+        return 0;
+    }
+
+    if (fstatat(store_dirfd, spath, &store_buf, 0) < 0) return -errno;
+    if (S_ISREG(sbuf->st_mode)) {
+        sbuf->st_size = store_buf.st_size;
+        sbuf->st_blksize = store_buf.st_blksize;
+        sbuf->st_blocks = store_buf.st_blocks;
+    }
+    return 0;
+}
+
+/* Stat a file, skipping the sides in skip, which are known not to have it, and
+ * adding the sides found not to have it to *missing */
+static int upfs_stat_neg(int perm_dirfd, int store_dirfd, const char *path,
+    const char *spath, struct stat *sbuf, int skip, int *missing)
+{
+    int ret;
+
+    if (skip & UPFS_NEG_PERM) {
+        ret = -1;
+        errno = ENOENT;
+    } else {
+        drop();
+        ret = UPFS(fstatat)(perm_dirfd, path, sbuf, AT_SYMLINK_NOFOLLOW);
+        regain();
+    }
+    if (ret >= 0)
+        return upfs_stat_store(store_dirfd, spath, sbuf);
+    if (errno != ENOENT) return -errno;
+    *missing |= UPFS_NEG_PERM;
+
+    if (skip & UPFS_NEG_STORE)
+        return -ENOENT;
+    ret = fstatat(store_dirfd, spath, sbuf, 0);
+    if (ret >= 0) return ret;
+    if (errno == ENOENT)
+        *missing |= UPFS_NEG_STORE;
+    return -errno;
+}
+
+static int upfs_stat(int perm_dirfd, int store_dirfd, const char *path, const char *spath, struct stat *sbuf)
+{
+    int missing = 0;
+    return upfs_stat_neg(perm_dirfd, store_dirfd, path, spath, sbuf, 0,
+        &missing);
+}
+
+/* Stat a name and get its node, for replying to the kernel, skipping and
+ * noting the sides which don't have it as in upfs_stat_neg */
+static int upfs_entry_neg(struct upfs_node *dir, const char *name,
+    struct upfs_loc *loc, struct fuse_entry_param *e, int skip, int *missing)
+{
+    struct upfs_node *node;
+    int ret;
+
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    ret = upfs_stat_neg(loc->perm_dir, loc->store_dir, loc->ppath, loc->spath,
+        &e->attr, skip, missing);
+    if (ret < 0) return ret;
+
+    pthread_mutex_lock(&nodes_lock);
+    node = node_get(dir, name);
+    pthread_mutex_unlock(&nodes_lock);
+    if (!node) return -ENOMEM;
+
+    node_mtime(node, &e->attr);
+    e->ino = node_ino(node);
+    e->attr.st_ino = e->ino;
+    e->attr_timeout = upfs_opts.attr_timeout;
+    e->entry_timeout = upfs_opts.entry_timeout;
+    return 0;
+}
+
+/* Stat a name and get its node, for replying to the kernel */
+static int upfs_entry(struct upfs_node *dir, const char *name,
+    struct upfs_loc *loc, struct fuse_entry_param *e)
+{
+    int missing = 0;
+    return upfs_entry_neg(dir, name, loc, e, 0, &missing);
+}
+
+/* Reply with an entry, or an error */
+static void reply_entry(fuse_req_t req, int ret, struct fuse_entry_param *e)
+{
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_entry(req, e);
+}
+
+/* For checking permissions ourselves, as the kernel would, we need callers'
+ * supplementary groups, which aren't in the request and have to be read from
+ * /proc. Each process's are remembered for groups_cache seconds, in a table
+ * indexed by pid, protected by creds_lock. */
+#define UPFS_CREDS 256
+struct upfs_cred {
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+    double expires;
+    int count;
+    gid_t *groups;
+};
+static pthread_mutex_t creds_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct upfs_cred creds[UPFS_CREDS];
+
+/* Get the caller's supplementary groups. Returns how many, with *groups
+ * malloc'd, or -errno. */
+static int read_groups(gid_t **groups)
+{
+    int count, size = 32;
+
+    for (;;) {
+        *groups = malloc(size * sizeof(gid_t));
+        if (!*groups)
+            return -ENOMEM;
+        count = fuse_req_getgroups(cur_req, size, *groups);
+        if (count <= size)
+            break;
+        free(*groups);
+        size = count;
+    }
+    if (count < 0) {
+        free(*groups);
+        *groups = NULL;
+    }
+    return count;
+}
+
+/* Is the caller in this group? */
+static int in_group(gid_t gid)
+{
+    const struct fuse_ctx *fctx = upfs_get_context();
+    struct upfs_cred *cred = &creds[fctx->pid % UPFS_CREDS];
+    gid_t *groups;
+    int count, i, ret = 0;
+    double t;
+
+    if (fctx->gid == gid)
+        return 1;
+
+    t = now();
+    pthread_mutex_lock(&creds_lock);
+    if (cred->pid == fctx->pid && cred->uid == fctx->uid &&
+        cred->gid == fctx->gid && cred->expires > t) {
+        UPFS_COUNT(groups_hit);
+        for (i = 0; i < cred->count; i++) {
+            if (cred->groups[i] == gid) {
+                ret = 1;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&creds_lock);
+        return ret;
+    }
+    pthread_mutex_unlock(&creds_lock);
+
+    /* Read them afresh. If we can't, the caller only has its own group. */
+    UPFS_COUNT(groups_miss);
+    count = read_groups(&groups);
+    if (count < 0)
+        return 0;
+    for (i = 0; i < count; i++) {
+        if (groups[i] == gid) {
+            ret = 1;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&creds_lock);
+    free(cred->groups);
+    cred->pid = fctx->pid;
+    cred->uid = fctx->uid;
+    cred->gid = fctx->gid;
+    cred->expires = t + upfs_opts.groups_cache;
+    cred->count = count;
+    cred->groups = groups;
+    pthread_mutex_unlock(&creds_lock);
+    return ret;
+}
+
+/* May the caller access something with these attributes as mode (R_OK, W_OK
+ * and X_OK) asks? 0 or -EACCES. */
+static int may(const struct stat *sbuf, int mode)
+{
+    const struct fuse_ctx *fctx = upfs_get_context();
+    mode_t bits;
+
+    mode &= R_OK|W_OK|X_OK;
+    if (fctx->uid == 0) {
+        /* Except that nobody may execute it */
+        if (!(mode & X_OK) || S_ISDIR(sbuf->st_mode) ||
+            (sbuf->st_mode & (S_IXUSR|S_IXGRP|S_IXOTH)))
+            return 0;
+    } else {
+        if (fctx->uid == sbuf->st_uid)
+            bits = sbuf->st_mode >> 6;
+        else if (in_group(sbuf->st_gid))
+            bits = sbuf->st_mode >> 3;
+        else
+            bits = sbuf->st_mode;
+        if ((bits & mode) == (mode_t) mode)
+            return 0;
+    }
+    UPFS_COUNT(perm_denied);
+    return -EACCES;
+}
+
+#ifdef UPFS_PS
+/* The store holds no permissions for the kernel to check, so without
+ * default_permissions, upfs-ps checks them itself against the index files, as
+ * the kernel would. */
+
+/* Does the caller own something with these attributes, or is it root? */
+static int owns(const struct stat *sbuf)
+{
+    uid_t uid = upfs_get_context()->uid;
+    return uid == 0 || uid == sbuf->st_uid;
+}
+
+/* The attributes which decide access to a location: the perm side's, or the
+ * store's if it hasn't been claimed */
+static int loc_perms(struct upfs_loc *loc, struct stat *sbuf)
+{
+    if (UPFS(fstatat)(loc->perm_dir, loc->ppath, sbuf, AT_SYMLINK_NOFOLLOW) == 0)
+        return 0;
+    if (errno != ENOENT)
+        return -errno;
+    if (fstatat(loc->store_dir, loc->spath, sbuf, 0) < 0)
+        return -errno;
+    return 0;
+}
+
+/* May the caller access a location? */
+static int may_loc(struct upfs_loc *loc, int mode)
+{
+    struct stat sbuf;
+    int ret;
+
+    if (upfs_opts.default_permissions)
+        return 0;
+    ret = loc_perms(loc, &sbuf);
+    if (ret < 0)
+        return ret;
+    return may(&sbuf, mode);
+}
+
+/* May the caller access a node, typically the directory of an operation? */
+static int may_node(struct upfs_node *node, int mode)
+{
+    struct upfs_loc loc;
+    int ret;
+
+    if (upfs_opts.default_permissions)
+        return 0;
+    ret = node_loc(node, &loc);
+    if (ret < 0)
+        return ret;
+    ret = may_loc(&loc, mode);
+    loc_release(&loc);
+    return ret;
+}
+
+/* May the caller remove or replace a name in a directory? That takes write
+ * and search permission on it, and if it's sticky, owning one or the other. */
+static int may_delete(struct upfs_node *dir, struct upfs_loc *loc)
+{
+    struct upfs_loc dloc;
+    struct stat dbuf, sbuf;
+    int ret;
+
+    if (upfs_opts.default_permissions)
+        return 0;
+    ret = node_loc(dir, &dloc);
+    if (ret < 0)
+        return ret;
+    ret = loc_perms(&dloc, &dbuf);
+    loc_release(&dloc);
+    if (ret < 0)
+        return ret;
+    ret = may(&dbuf, W_OK|X_OK);
+    if (ret < 0 || !(dbuf.st_mode & S_ISVTX) || owns(&dbuf))
+        return ret;
+
+    /* Nothing there is left to the operation to report */
+    ret = loc_perms(loc, &sbuf);
+    if (ret == -ENOENT || (ret == 0 && owns(&sbuf)))
+        return 0;
+    return ret < 0 ? ret : -EPERM;
+}
+
+/* May the caller rename from one location to another? Moving a directory to
+ * another parent also changes its .., so takes write permission on it. */
+static int may_rename(struct upfs_node *from_dir, struct upfs_loc *from,
+    struct upfs_node *to_dir, struct upfs_loc *to)
+{
+    struct stat sbuf;
+    int ret;
+
+    ret = may_delete(from_dir, from);
+    if (ret == 0)
+        ret = may_delete(to_dir, to);
+    if (ret < 0 || from_dir == to_dir || upfs_opts.default_permissions)
+        return ret;
+    if (loc_perms(from, &sbuf) < 0 || !S_ISDIR(sbuf.st_mode))
+        return 0;
+    return may(&sbuf, W_OK);
+}
+
+/* May the caller change these attributes? Also clears the set-group-ID bit
+ * from a new mode if the caller isn't in the group, and the set-user-ID and
+ * set-group-ID bits of a file chowned by anyone but root, as the kernel does.
+ * libfuse takes on FUSE_CAP_HANDLE_KILLPRIV, so the kernel leaves the latter
+ * to us even with default_permissions. It adds the new mode to to_set. */
+static int may_setattr(struct upfs_loc *loc, struct stat *attr, int *to_set_io,
+    struct fuse_file_info *ffi)
+{
+    uid_t uid = upfs_get_context()->uid;
+    int to_set = *to_set_io;
+    int chowning = uid != 0 && !(to_set & FUSE_SET_ATTR_MODE) &&
+        (to_set & (FUSE_SET_ATTR_UID|FUSE_SET_ATTR_GID));
+    struct stat sbuf;
+    gid_t gid;
+    int ret;
+
+    if (upfs_opts.default_permissions && !chowning)
+        return 0;
+    ret = loc_perms(loc, &sbuf);
+    if (ret < 0)
+        return ret;
+    if (upfs_opts.default_permissions)
+        goto clear;
+    gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : sbuf.st_gid;
+
+    if ((to_set & FUSE_SET_ATTR_UID) && attr->st_uid != sbuf.st_uid &&
+        uid != 0)
+        return -EPERM;
+    if ((to_set & FUSE_SET_ATTR_GID) && attr->st_gid != sbuf.st_gid &&
+        uid != 0 && (uid != sbuf.st_uid || !in_group(attr->st_gid)))
+        return -EPERM;
+
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        if (!owns(&sbuf))
+            return -EPERM;
+        if (uid != 0 && (attr->st_mode & S_ISGID) &&
+            !in_group(gid))
+            attr->st_mode &= ~S_ISGID;
+    }
+
+    if ((to_set & FUSE_SET_ATTR_SIZE) && !ffi) {
+        ret = may(&sbuf, W_OK);
+        if (ret < 0)
+            return ret;
+    }
+
+    /* Times may be set to now with write permission, otherwise only by their
+     * owner */
+    if ((to_set & FUSE_SET_ATTR_ATIME && !(to_set & FUSE_SET_ATTR_ATIME_NOW)) ||
+        (to_set & FUSE_SET_ATTR_MTIME && !(to_set & FUSE_SET_ATTR_MTIME_NOW))) {
+        if (!owns(&sbuf))
+            return -EPERM;
+    } else if (to_set & (FUSE_SET_ATTR_ATIME|FUSE_SET_ATTR_MTIME)) {
+        if (!owns(&sbuf))
+            return may(&sbuf, W_OK);
+    }
+
+clear:
+    /* Without group execute, set-group-ID marks mandatory locking instead */
+    if (chowning && !S_ISDIR(sbuf.st_mode) && ((sbuf.st_mode & S_ISUID) ||
+        (sbuf.st_mode & (S_ISGID|S_IXGRP)) == (S_ISGID|S_IXGRP))) {
+        attr->st_mode = sbuf.st_mode & ~(S_ISUID|S_ISGID);
+        if (!(sbuf.st_mode & S_IXGRP))
+            attr->st_mode |= sbuf.st_mode & S_ISGID;
+        *to_set_io |= FUSE_SET_ATTR_MODE;
+    }
+    return 0;
+}
+
+/* The access an open asks for */
+static int open_mode(int flags)
+{
+    int mode = 0;
+    if ((flags & O_ACCMODE) != O_WRONLY)
+        mode |= R_OK;
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC))
+        mode |= W_OK;
+    return mode;
+}
+
+#else
+/* The kernel checks permissions on the perm side for us, as we drop to the
+ * caller's credentials */
+#define may_loc(loc, mode) 0
+#define may_node(node, mode) 0
+#define may_delete(dir, loc) 0
+#define may_rename(from_dir, from, to_dir, to) 0
+#define may_setattr(loc, attr, to_set_io, ffi) 0
+
+#endif
+
+static void upfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    int ret;
+    int skip, missing = 0;
+    uint64_t neg_gen;
+    struct upfs_node *dir = get_node(parent);
+    struct upfs_loc loc;
+    struct fuse_entry_param e;
+    begin(req);
+    UPFS_COUNT(lookup);
+
+    ret = may_node(dir, X_OK);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    ret = child_loc(dir, name, &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    /* Skip looking where we already know it isn't. Without
+     * default_permissions, looking on the perm side is how the caller's search
+     * permission is checked, so that can't be skipped, except by upfs-ps,
+     * which has checked it already. */
+    pthread_mutex_lock(&nodes_lock);
+    skip = neg_find(dir, name, &neg_gen);
+    pthread_mutex_unlock(&nodes_lock);
+#ifndef UPFS_PS
+    if (!upfs_opts.default_permissions)
+        skip &= ~UPFS_NEG_PERM;
+#endif
+    if (skip & UPFS_NEG_PERM)
+        UPFS_COUNT(neg_perm_hit);
+    if (skip & UPFS_NEG_STORE)
+        UPFS_COUNT(neg_store_hit);
+
+    ret = upfs_entry_neg(dir, name, &loc, &e, skip, &missing);
+    if (ret == 0 || ret == -ENOENT) {
+        pthread_mutex_lock(&nodes_lock);
+        neg_add(dir, name, neg_gen, missing);
+        pthread_mutex_unlock(&nodes_lock);
+    }
+    loc_release(&loc);
+
+    if (ret == -ENOENT && upfs_opts.negative_timeout > 0) {
+        /* Let the kernel remember that it doesn't exist */
+        memset(&e, 0, sizeof(struct fuse_entry_param));
+        e.entry_timeout = upfs_opts.negative_timeout;
+        ret = 0;
+    }
+    reply_entry(req, ret, &e);
+}
+
+static void upfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    begin(req);
+    pthread_mutex_lock(&nodes_lock);
+    node_unref(get_node(ino), nlookup);
+    pthread_mutex_unlock(&nodes_lock);
+    fuse_reply_none(req);
+}
+
+static void upfs_forget_multi(fuse_req_t req, size_t count,
+    struct fuse_forget_data *forgets)
+{
+    size_t i;
+    begin(req);
+    pthread_mutex_lock(&nodes_lock);
+    for (i = 0; i < count; i++)
+        node_unref(get_node(forgets[i].ino), forgets[i].nlookup);
+    pthread_mutex_unlock(&nodes_lock);
+    fuse_reply_none(req);
+}
+
+static int upfs_fgetattr(struct upfs_loc *loc, struct stat *sbuf, struct fuse_file_info *ffi)
+{
+#ifdef UPFS_PS
+    /* We just have to stat the path and hope it hasn't been changed */
+    return upfs_stat(loc->perm_dir, loc->store_dir, loc->ppath, loc->spath, sbuf);
+
+#else
+    struct upfs_file *file;
+    int ret;
+    struct stat store_buf;
+
+    file = get_file(ffi);
+
+    /* Opened for reading without being claimed, but it may have been since */
+    if (file->perm_fd < 0)
+        return upfs_stat(loc->perm_dir, loc->store_dir, loc->ppath, loc->spath, sbuf);
+
+    ret = fstat(file->perm_fd, sbuf);
+    if (ret < 0) return -errno;
+
+    if (S_ISREG(sbuf->st_mode)) {
+        ret = fstat(file->store_fd, &store_buf);
+        if (ret < 0) return -errno;
+        sbuf->st_size = store_buf.st_size;
+        sbuf->st_blksize = store_buf.st_blksize;
+        sbuf->st_blocks = store_buf.st_blocks;
+    }
+
+#endif
+
+    return 0;
+}
+
+static void upfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *ffi)
+{
+    int ret;
+    struct stat sbuf;
+    struct upfs_loc loc;
+    begin(req);
+    UPFS_COUNT(getattr);
+
+    ret = node_loc(get_node(ino), &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    if (ffi)
+        ret = upfs_fgetattr(&loc, &sbuf, ffi);
+    else
+        ret = upfs_stat(loc.perm_dir, loc.store_dir, loc.ppath, loc.spath, &sbuf);
+    loc_release(&loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    node_mtime(get_node(ino), &sbuf);
+    sbuf.st_ino = ino;
+    fuse_reply_attr(req, &sbuf, upfs_opts.attr_timeout);
+}
+
+static void upfs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    ssize_t ret;
+    char buf[PATH_MAX];
+    struct upfs_loc loc;
+#ifdef UPFS_PS
+    struct stat sbuf;
+    int fd;
+#endif
+    begin(req);
+
+    ret = node_loc(get_node(ino), &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+#ifdef UPFS_PS
+    /* We store the link target in the store file, so just check that it claims
+     * to be a link */
+    ret = UPFS(fstatat)(loc.perm_dir, loc.ppath, &sbuf, 0);
+    if (ret < 0) goto error;
+    if (!S_ISLNK(sbuf.st_mode)) {
+        errno = EINVAL;
+        goto error;
+    }
+
+    /* Then read it */
+    fd = openat(loc.store_dir, loc.spath, O_RDONLY);
+    if (fd < 0) goto error;
+    ret = read(fd, buf, PATH_MAX-1);
+    if (ret < 0) {
+        int save_errno = errno;
+        close(fd);
+        errno = save_errno;
+        goto error;
+    }
+    close(fd);
+
+#else
+    /* The link is stored as a link in the permissions directory */
+    drop();
+    ret = UPFS(readlinkat)(loc.perm_dir, loc.ppath, buf, PATH_MAX-1);
+    regain();
+    if (ret < 0) goto error;
+
+#if 0
+    FIXME: For now, allow links with no backing file
+    ret = fstatat(loc.store_dir, loc.spath, &sbuf, 0);
+    if (ret < 0) goto error;
+#endif
+
+#endif
+
+    loc_release(&loc);
+    buf[ret] = 0;
+    fuse_reply_readlink(req, buf);
+    return;
+
+error:
+    ret = errno;
+    loc_release(&loc);
+    fuse_reply_err(req, ret);
+}
+
+static void upfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+    mode_t mode, dev_t dev)
+{
+    int ret;
+    struct upfs_node *dir = get_node(parent);
+    struct upfs_loc loc;
+    struct fuse_entry_param e;
+    begin(req);
+
+    ret = child_loc(dir, name, &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    ret = may_node(dir, W_OK|X_OK);
+    if (ret < 0)
+        goto done;
+
+    /* Create the full thing on the perms fs */
+    drop();
+    ret = UPFS(mknodat)(loc.perm_dir, loc.ppath, mode, dev);
+    regain();
+    if (ret < 0) {
+        ret = -errno;
+        goto done;
+    }
+
+    /* Then create an empty file to represent it on the store */
+    ret = mknodat(loc.store_dir, loc.spath, S_IFREG|0600, 0);
+    if (ret < 0) {
+        ret = -errno;
+        goto done;
+    }
+
+    ret = upfs_entry(dir, name, &loc, &e);
+
+done:
+    loc_neg_clear(&loc);
+    loc_release(&loc);
+    reply_entry(req, ret, &e);
+}
+
+static void upfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+    mode_t mode)
+{
+    int ret;
+    struct upfs_node *dir = get_node(parent);
+    struct upfs_loc loc;
+    struct fuse_entry_param e;
+    begin(req);
+
+    ret = child_loc(dir, name, &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    ret = may_node(dir, W_OK|X_OK);
+    if (ret < 0)
+        goto done;
 
     drop();
-    ret = UPFS(mkdirat)(perm_root, ppath, mode);
+    ret = UPFS(mkdirat)(loc.perm_dir, loc.ppath, mode);
     regain();
-    if (ret < 0) return -errno;
+    if (ret < 0) {
+        ret = -errno;
+        goto done;
+    }
 
-    ret = mkdirat(store_root, spath, 0700);
-    if (ret < 0) return -errno;
-    return 0;
+    ret = mkdirat(loc.store_dir, loc.spath, 0700);
+    if (ret < 0) {
+        ret = -errno;
+        goto done;
+    }
+
+    ret = upfs_entry(dir, name, &loc, &e);
+
+done:
+    loc_neg_clear(&loc);
+    loc_release(&loc);
+    reply_entry(req, ret, &e);
 }
 
-static int upfs_unlink(const char *path)
+static void upfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     /* For removing files/directories, we need to do it in the opposite order
      * to assure no race conditions in permissions and visibility */
-    int perm_ret, store_ret;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
+    int perm_ret, store_ret, ret;
+    struct upfs_node *dir = get_node(parent);
+    struct upfs_loc loc;
+    begin(req);
+
+    ret = child_loc(dir, name, &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    ret = -may_delete(dir, &loc);
+    if (ret)
+        goto done;
 
-    store_ret = unlinkat(store_root, spath, 0);
-    if (store_ret < 0 && errno != ENOENT) return -errno;
+    store_ret = unlinkat(loc.store_dir, loc.spath, 0);
+    if (store_ret < 0 && errno != ENOENT) {
+        ret = errno;
+        goto done;
+    }
 
     drop();
-    perm_ret = UPFS(unlinkat)(perm_root, ppath, 0);
+    perm_ret = UPFS(unlinkat)(loc.perm_dir, loc.ppath, 0);
     regain();
-    if (perm_ret < 0 && errno != ENOENT) return -errno;
+    if (perm_ret < 0 && errno != ENOENT) {
+        ret = errno;
+        goto done;
+    }
 
-    if (store_ret < 0) return -ENOENT;
-    return 0;
+    if (store_ret < 0) {
+        ret = ENOENT;
+        goto done;
+    }
+    node_remove(dir, name);
+    loc_inval_aliases(&loc, 1);
+
+done:
+    loc_release(&loc);
+    fuse_reply_err(req, ret);
 }
 
-static int upfs_rmdir(const char *path)
+static void upfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    int perm_ret, store_ret;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
+    int perm_ret, store_ret, ret;
+    struct upfs_node *dir = get_node(parent);
+    struct upfs_loc loc;
+    begin(req);
+
+    ret = child_loc(dir, name, &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    ret = -may_delete(dir, &loc);
+    if (ret)
+        goto done;
 
 #ifdef UPFS_PS
     /* The index file will cause problems */
-    UPFS(unlink_empty_index)(perm_root, ppath);
+    UPFS(unlink_empty_index)(loc.perm_dir, loc.ppath);
 #endif
 
-    store_ret = unlinkat(store_root, spath, AT_REMOVEDIR);
-    if (store_ret < 0 && errno != ENOENT) return -errno;
+    store_ret = unlinkat(loc.store_dir, loc.spath, AT_REMOVEDIR);
+    if (store_ret < 0 && errno != ENOENT) {
+        ret = errno;
+        goto done;
+    }
 
     drop();
-    perm_ret = UPFS(unlinkat)(perm_root, ppath, AT_REMOVEDIR);
+    perm_ret = UPFS(unlinkat)(loc.perm_dir, loc.ppath, AT_REMOVEDIR);
     regain();
-    if (perm_ret < 0 && errno != ENOENT) return -errno;
+    if (perm_ret < 0 && errno != ENOENT) {
+        ret = errno;
+        goto done;
+    }
 
-    if (store_ret < 0) return -ENOENT;
-    return 0;
+    if (store_ret < 0) {
+        ret = ENOENT;
+        goto done;
+    }
+    node_remove(dir, name);
+    loc_inval_aliases(&loc, 1);
+
+done:
+    loc_release(&loc);
+    fuse_reply_err(req, ret);
 }
 
-static int upfs_symlink(const char *target, const char *path)
+static void upfs_symlink(fuse_req_t req, const char *target, fuse_ino_t parent,
+    const char *name)
 {
     int ret;
-    char ppath[PATH_MAX], spath[PATH_MAX];
+    struct upfs_node *dir = get_node(parent);
+    struct upfs_loc loc;
+    struct fuse_entry_param e;
 #ifdef UPFS_PS
     int fd;
     size_t target_sz;
 #endif
-    correct_path(path, ppath, spath);
+    begin(req);
+
+    ret = child_loc(dir, name, &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    ret = may_node(dir, W_OK|X_OK);
+    if (ret < 0)
+        goto done;
 
 #ifdef UPFS_PS
     {
         /* As a special case, we ignore this if it's just a case link (symlink("foo", "FOO")) */
         char path_parts[PATH_MAX];
         char *path_dir, *path_file;
-        split_path(ppath, path_parts, &path_dir, &path_file, 0);
+        split_path(loc.ppath, path_parts, &path_dir, &path_file, 0);
         if (!strcasecmp(path_file, target))
-            return 0;
+            goto entry;
     }
 
     /* We store the symlink in the store, so do this totally differently */
-    ret = UPFS(mknodat)(perm_root, ppath, S_IFREG, 0);
+    ret = UPFS(mknodat)(loc.perm_dir, loc.ppath, S_IFREG, 0);
     if (ret < 0 && errno == ENOENT) {
         /* Create containing directories */
-        mkdir_p(ppath);
-        ret = UPFS(mknodat)(perm_root, ppath, S_IFREG, 0);
+        mkdir_p(&loc);
+        ret = UPFS(mknodat)(loc.perm_dir, loc.ppath, S_IFREG, 0);
+    }
+    if (ret < 0) {
+        ret = -errno;
+        goto done;
     }
-    if (ret < 0) return -errno;
 
     /* Now write the symlink file */
-    fd = openat(store_root, spath, O_WRONLY|O_CREAT|O_EXCL, 0600);
-    if (fd < 0) return -errno;
+    fd = openat(loc.store_dir, loc.spath, O_WRONLY|O_CREAT|O_EXCL, 0600);
+    if (fd < 0) {
+        ret = -errno;
+        goto done;
+    }
     target_sz = strlen(target);
-    if (write(fd, target, target_sz) != target_sz) {
+    if (write(fd, target, target_sz) != (ssize_t) target_sz) {
         int save_errno = errno;
         close(fd);
-        if (save_errno) return -save_errno;
-        return -EIO;
+        ret = save_errno ? -save_errno : -EIO;
+        goto done;
     }
     close(fd);
 
     /* Then replace it in the permissions */
-    ret = UPFS(fchmodat_harder)(perm_root, ppath, S_IFLNK|0644, 0);
-    if (ret < 0) return -errno;
-
-    return 0;
+    ret = UPFS(fchmodat_harder)(loc.perm_dir, loc.ppath, S_IFLNK|0644, 0);
+    if (ret < 0) {
+        ret = -errno;
+        goto done;
+    }
 
 #else
     drop();
-    ret = UPFS(symlinkat)(target, perm_root, ppath);
+    ret = UPFS(symlinkat)(target, loc.perm_dir, loc.ppath);
     regain();
     if (ret < 0 && errno == ENOENT) {
         /* Maybe need to create containing directories */
         drop();
-        mkdir_p(ppath);
-        ret = UPFS(symlinkat)(target, perm_root, ppath);
+        mkdir_p(&loc);
+        ret = UPFS(symlinkat)(target, loc.perm_dir, loc.ppath);
         regain();
     }
-    if (ret < 0) return -errno;
+    if (ret < 0) {
+        ret = -errno;
+        goto done;
+    }
 
-    ret = mknodat(store_root, spath, S_IFREG|0600, 0);
+    ret = mknodat(loc.store_dir, loc.spath, S_IFREG|0600, 0);
     if (ret < 0) {
 #ifdef UPFS_FATNAMES /* FIXME: Not really related */
         if (errno == EEXIST) {
             /* As a special case, we ignore this if it's just a case link (symlink("foo", "FOO")) */
             char path_parts[PATH_MAX];
             char *path_dir, *path_file;
-            split_path(ppath, path_parts, &path_dir, &path_file, 0);
+            split_path(loc.ppath, path_parts, &path_dir, &path_file, 0);
             if (!strcasecmp(path_file, target))
-                return 0;
+                goto entry;
         }
 #endif
-        return -errno;
+        ret = -errno;
+        goto done;
     }
-    return 0;
 
 #endif
+
+#if defined(UPFS_PS) || defined(UPFS_FATNAMES)
+entry:
+#endif
+    ret = upfs_entry(dir, name, &loc, &e);
+
+done:
+    loc_neg_clear(&loc);
+    loc_release(&loc);
+    reply_entry(req, ret, &e);
 }
 
-static int upfs_rename(const char *from, const char *to)
+static void upfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+    fuse_ino_t newparent, const char *newname, unsigned int flags)
 {
     int perm_ret, store_ret;
     struct stat sbuf;
@@ -415,35 +2362,54 @@ static int upfs_rename(const char *from, const char *to)
     int from_dir_fd = -1, to_dir_fd = -1;
     int made_placeholder = 0;
     int save_errno;
-    char pfrom[PATH_MAX], sfrom[PATH_MAX], pto[PATH_MAX], sto[PATH_MAX];
-    correct_path(from, pfrom, sfrom);
-    correct_path(to, pto, sto);
+    struct upfs_node *from_node = get_node(parent), *to_node = get_node(newparent);
+    struct upfs_loc from, to;
+    begin(req);
+
+    if (flags) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    save_errno = child_loc(from_node, name, &from);
+    if (save_errno < 0) {
+        fuse_reply_err(req, -save_errno);
+        return;
+    }
+    save_errno = child_loc(to_node, newname, &to);
+    if (save_errno < 0) {
+        loc_release(&from);
+        fuse_reply_err(req, -save_errno);
+        return;
+    }
+    save_errno = may_rename(from_node, &from, to_node, &to);
+    if (save_errno < 0) {
+        errno = -save_errno;
+        goto error;
+    }
 
     /* To avoid directory renaming causing issues and assure some kind of
-     * atomicity, get directory handles first */
-    split_path(pfrom, from_parts, &from_dir, &from_file, 0);
-    split_path(pto, to_parts, &to_dir, &to_file, 0);
+     * atomicity, get directory handles first. Everything up to placing the
+     * new file is on the perm side, so it's all done as the caller. */
+    split_path(from.ppath, from_parts, &from_dir, &from_file, 0);
+    split_path(to.ppath, to_parts, &to_dir, &to_file, 0);
     drop();
-    from_dir_fd = openat(perm_root, from_dir, O_RDONLY, 0);
-    regain();
+    from_dir_fd = openat(from.perm_dir, from_dir, O_RDONLY, 0);
     if (from_dir_fd < 0) goto error;
-    drop();
-    to_dir_fd = openat(perm_root, to_dir, O_RDONLY, 0);
-    regain();
+    to_dir_fd = openat(to.perm_dir, to_dir, O_RDONLY, 0);
     if (to_dir_fd < 0) goto error;
 
     /* Get the properties of the original file */
-    drop();
     perm_ret = UPFS(fstatat)(from_dir_fd, from_file, &sbuf, AT_SYMLINK_NOFOLLOW);
-    regain();
     if (perm_ret < 0) {
         if (errno != ENOENT) goto error;
 
         /* Doesn't exist in the permissions, so just rename in the store */
+        regain();
         close(from_dir_fd);
         close(to_dir_fd);
         from_dir_fd = to_dir_fd = -1;
-        store_ret = renameat(store_root, sfrom, store_root, sto);
+        store_ret = renameat(from.store_dir, from.spath, to.store_dir, to.spath);
         if (store_ret < 0) goto error;
         errno = 0;
         goto error;
@@ -451,30 +2417,24 @@ static int upfs_rename(const char *from, const char *to)
     dir = S_ISDIR(sbuf.st_mode);
 
     /* Set up an inaccessible new file to prevent tampering */
-    drop();
-    mkdir_p(pto);
+    mkdir_p(&to);
     if (dir)
         perm_ret = UPFS(mkdirat)(to_dir_fd, to_file, 0);
     else
         perm_ret = UPFS(mknodat)(to_dir_fd, to_file, 0, 0);
-    regain();
     made_placeholder = 1;
     if (perm_ret < 0 && errno == EEXIST) {
         /* We're overwriting a file. Just set its permissions to nil, unless it's a symlink. */
-        drop();
         perm_ret = UPFS(fstatat)(to_dir_fd, to_file, &sbuf, AT_SYMLINK_NOFOLLOW);
-        regain();
-        if (perm_ret < 0 || !S_ISLNK(sbuf.st_mode)) {
-            drop();
+        if (perm_ret < 0 || !S_ISLNK(sbuf.st_mode))
             perm_ret = UPFS(fchmodat)(to_dir_fd, to_file, 0, 0);
-            regain();
-        }
         made_placeholder = 0;
     }
+    regain();
     if (perm_ret < 0) goto error;
 
     /* Rename it in the store */
-    store_ret = renameat(store_root, sfrom, store_root, sto);
+    store_ret = renameat(from.store_dir, from.spath, to.store_dir, to.spath);
     if (store_ret < 0) goto error;
 
     /* And rename it in the permissions */
@@ -485,9 +2445,17 @@ static int upfs_rename(const char *from, const char *to)
 
     close(from_dir_fd);
     close(to_dir_fd);
-    return 0;
+    node_move(from_node, name, to_node, newname);
+    loc_inval_aliases(&from, 1);
+    loc_inval_aliases(&to, 1);
+    loc_release(&from);
+    loc_neg_clear(&to);
+    loc_release(&to);
+    fuse_reply_err(req, 0);
+    return;
 
 error:
+    regain();
     save_errno = errno;
     if (from_dir_fd >= 0) close(from_dir_fd);
     if (to_dir_fd >= 0) {
@@ -495,50 +2463,141 @@ error:
             UPFS(unlinkat)(to_dir_fd, to_file, dir?AT_REMOVEDIR:0);
         close(to_dir_fd);
     }
-    errno = save_errno;
-    return -errno;
+    if (!save_errno) {
+        node_move(from_node, name, to_node, newname);
+        loc_inval_aliases(&from, 1);
+        loc_inval_aliases(&to, 1);
+    }
+    loc_release(&from);
+    loc_neg_clear(&to);
+    loc_release(&to);
+    fuse_reply_err(req, save_errno);
 }
 
 #ifdef UPFS_LNCP
+/* How much to copy at a time, in the kernel or through a buffer */
+#define LNCP_CHUNK (1024*1024*1024)
+#define LNCP_BUFSZ (1024*1024)
+
+/* Copy one store file into another, freshly created one: as a reflink if the
+ * store can share extents, else within the kernel, else through a buffer */
+static int lncp_copy(int from_fd, int to_fd, off_t size)
+{
+    char *buf;
+    ssize_t rd, wr, off;
+
+#ifdef FICLONE
+    if (ioctl(to_fd, FICLONE, from_fd) == 0) {
+        UPFS_COUNT(lncp_clone);
+        return 0;
+    }
+#endif
+
+    /* Allocate it all at once, so it isn't grown piecemeal. Not every store
+     * can, and it's only an optimization. */
+    if (size > 0)
+        fallocate(to_fd, FALLOC_FL_KEEP_SIZE, 0, size);
+
+    /* The buffer below can be faster when both files are in the page cache,
+     * but copy_file_range costs no copies through user space and no memory,
+     * and network and copy-on-write stores can do it without moving the
+     * data at all */
+    for (;;) {
+        rd = copy_file_range(from_fd, NULL, to_fd, NULL, LNCP_CHUNK, 0);
+        if (rd > 0)
+            UPFS_COUNT_N(lncp_kernel_bytes, rd);
+        else if (rd == 0 || (errno != EINTR && errno != EAGAIN))
+            break;
+    }
+    if (rd == 0)
+        return 0;
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+        errno != EOPNOTSUPP)
+        return -1;
+
+    /* The kernel can't, so carry on from wherever it stopped ourselves */
+    buf = malloc(LNCP_BUFSZ);
+    if (!buf)
+        return -1;
+    while ((rd = read(from_fd, buf, LNCP_BUFSZ)) != 0) {
+        if (rd < 0) {
+            if (errno == EINTR) continue;
+            goto error;
+        }
+        for (off = 0; off < rd; off += wr) {
+            wr = write(to_fd, buf + off, rd - off);
+            if (wr < 0) {
+                if (errno == EINTR) {
+                    wr = 0;
+                    continue;
+                }
+                goto error;
+            }
+        }
+        UPFS_COUNT_N(lncp_buffer_bytes, rd);
+    }
+    free(buf);
+    return 0;
+
+error:
+    free(buf);
+    return -1;
+}
+
 /* A fake implementation of link through copying that may be good enough for
  * some purposes */
-static int upfs_lncp(const char *from, const char *to)
+static void upfs_lncp(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+    const char *newname)
 {
-#define BUFSZ 4096
-    int perm_ret, store_ret;
+    int perm_ret;
     struct stat sbuf;
     char from_parts[PATH_MAX], to_parts[PATH_MAX];
     char *from_dir, *from_file, *to_dir, *to_file;
     int from_dir_fd = -1, to_dir_fd = -1;
     int from_file_fd = -1, to_file_fd = -1;
-    char *buf = NULL;
-    ssize_t rd;
+    int perm_made = 0, store_made = 0;
     int save_errno;
-    char pfrom[PATH_MAX], sfrom[PATH_MAX], pto[PATH_MAX], sto[PATH_MAX];
-    correct_path(from, pfrom, sfrom);
-    correct_path(to, pto, sto);
+    struct upfs_node *to_node = get_node(newparent);
+    struct upfs_loc from, to;
+    struct fuse_entry_param e;
+    begin(req);
+
+    save_errno = node_loc(get_node(ino), &from);
+    if (save_errno < 0) {
+        fuse_reply_err(req, -save_errno);
+        return;
+    }
+    save_errno = child_loc(to_node, newname, &to);
+    if (save_errno < 0) {
+        loc_release(&from);
+        fuse_reply_err(req, -save_errno);
+        return;
+    }
+    save_errno = may_loc(&from, R_OK);
+    if (save_errno == 0)
+        save_errno = may_node(to_node, W_OK|X_OK);
+    if (save_errno < 0) {
+        errno = -save_errno;
+        goto error;
+    }
 
     /* To avoid directory renaming causing issues and assure some kind of
      * atomicity, get directory handles first */
-    split_path(pfrom, from_parts, &from_dir, &from_file, 0);
-    split_path(pto, to_parts, &to_dir, &to_file, 0);
+    split_path(from.ppath, from_parts, &from_dir, &from_file, 0);
+    split_path(to.ppath, to_parts, &to_dir, &to_file, 0);
     drop();
-    from_dir_fd = UPFS(openat)(perm_root, from_dir, O_RDONLY|O_DIRECTORY, 0);
-    regain();
+    from_dir_fd = UPFS(openat)(from.perm_dir, from_dir, O_RDONLY|O_DIRECTORY, 0);
     if (from_dir_fd < 0) goto error;
-    drop();
-    to_dir_fd = UPFS(openat)(perm_root, to_dir, O_RDONLY|O_DIRECTORY, 0);
-    regain();
+    to_dir_fd = UPFS(openat)(to.perm_dir, to_dir, O_RDONLY|O_DIRECTORY, 0);
     if (to_dir_fd < 0) goto error;
 
     /* Get the properties of the original file */
-    drop();
     perm_ret = UPFS(fstatat)(from_dir_fd, from_file, &sbuf, AT_SYMLINK_NOFOLLOW);
     regain();
     if (perm_ret < 0) {
         if (errno != ENOENT) goto error;
 
-        perm_ret = fstatat(store_root, sfrom, &sbuf, AT_SYMLINK_NOFOLLOW);
+        perm_ret = fstatat(from.store_dir, from.spath, &sbuf, AT_SYMLINK_NOFOLLOW);
         if (perm_ret < 0) goto error;
     }
 
@@ -550,24 +2609,20 @@ static int upfs_lncp(const char *from, const char *to)
 
     /* Set up the new permissions file */
     drop();
-    mkdir_p(pto);
+    mkdir_p(&to);
     perm_ret = UPFS(mknodat)(to_dir_fd, to_file, sbuf.st_mode, 0);
     regain();
     if (perm_ret < 0) goto error;
+    perm_made = 1;
 
     /* Copy it in the store */
-    from_file_fd = openat(store_root, sfrom, O_RDONLY);
+    from_file_fd = openat(from.store_dir, from.spath, O_RDONLY);
     if (from_file_fd < 0) goto error;
-    to_file_fd = openat(store_root, sto, O_WRONLY|O_CREAT|O_EXCL);
+    if (fstat(from_file_fd, &sbuf) < 0) goto error;
+    to_file_fd = openat(to.store_dir, to.spath, O_WRONLY|O_CREAT|O_EXCL, 0600);
     if (to_file_fd < 0) goto error;
-    buf = malloc(BUFSZ);
-    if (!buf) goto error;
-    while ((rd = read(from_file_fd, buf, BUFSZ)) > 0) {
-        if (write(to_file_fd, buf, rd) != rd) goto error;
-    }
-    if (rd < 0) goto error;
-    free(buf);
-    buf = NULL;
+    store_made = 1;
+    if (lncp_copy(from_file_fd, to_file_fd, sbuf.st_size) < 0) goto error;
     close(to_file_fd);
     to_file_fd = -1;
     close(from_file_fd);
@@ -575,39 +2630,54 @@ static int upfs_lncp(const char *from, const char *to)
 
     close(from_dir_fd);
     close(to_dir_fd);
-    return 0;
+
+    save_errno = upfs_entry(to_node, newname, &to, &e);
+    loc_release(&from);
+    loc_neg_clear(&to);
+    loc_release(&to);
+    reply_entry(req, save_errno, &e);
+    return;
 
 error:
+    regain();
     save_errno = errno;
     if (from_dir_fd >= 0) close(from_dir_fd);
-    if (to_dir_fd >= 0) close(to_dir_fd);
     if (from_file_fd >= 0) close(from_file_fd);
     if (to_file_fd >= 0) close(to_file_fd);
-    if (buf) free(buf);
-    errno = save_errno;
-    return -errno;
+
+    /* Don't leave half a copy behind */
+    if (store_made)
+        unlinkat(to.store_dir, to.spath, 0);
+    if (perm_made) {
+        drop();
+        UPFS(unlinkat)(to_dir_fd, to_file, 0);
+        regain();
+    }
+    if (to_dir_fd >= 0) close(to_dir_fd);
+    loc_release(&from);
+    loc_neg_clear(&to);
+    loc_release(&to);
+    fuse_reply_err(req, save_errno);
 }
 #endif
 
-static int upfs_chmod(const char *path, mode_t mode)
+static int upfs_chmod(struct upfs_loc *loc, mode_t mode)
 {
     int perm_ret, store_ret;
     struct stat sbuf;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
 
     drop();
-    perm_ret = UPFS(fchmodat)(perm_root, ppath, mode, 0);
+    perm_ret = UPFS(fchmodat)(loc->perm_dir, loc->ppath, mode, 0);
     regain();
     if (perm_ret < 0 && errno != ENOENT) return -errno;
 
-    store_ret = fstatat(store_root, spath, &sbuf, 0);
+    store_ret = fstatat(loc->store_dir, loc->spath, &sbuf, 0);
     if (store_ret < 0) return -errno;
 
     if (perm_ret < 0) {
         drop();
-        mkfull(ppath, &sbuf);
-        perm_ret = UPFS(fchmodat)(perm_root, ppath, mode, 0);
+        mkfull(loc, &sbuf);
+        perm_ret = UPFS(fchmodat)(loc->perm_dir, loc->ppath, mode, 0);
         regain();
     }
 
@@ -615,25 +2685,23 @@ static int upfs_chmod(const char *path, mode_t mode)
     return 0;
 }
 
-static int upfs_chown(const char *path, uid_t uid, gid_t gid)
+static int upfs_chown(struct upfs_loc *loc, uid_t uid, gid_t gid)
 {
     int perm_ret, store_ret;
     struct stat sbuf;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
 
     drop();
-    perm_ret = UPFS(fchownat)(perm_root, ppath, uid, gid, AT_SYMLINK_NOFOLLOW);
+    perm_ret = UPFS(fchownat)(loc->perm_dir, loc->ppath, uid, gid, AT_SYMLINK_NOFOLLOW);
     regain();
     if (perm_ret < 0 && errno != ENOENT) return -errno;
 
-    store_ret = fstatat(store_root, spath, &sbuf, 0);
+    store_ret = fstatat(loc->store_dir, loc->spath, &sbuf, 0);
     if (store_ret < 0) return -errno;
 
     if (perm_ret < 0) {
         drop();
-        mkfull(ppath, &sbuf);
-        perm_ret = UPFS(fchownat)(perm_root, ppath, uid, gid, AT_SYMLINK_NOFOLLOW);
+        mkfull(loc, &sbuf);
+        perm_ret = UPFS(fchownat)(loc->perm_dir, loc->ppath, uid, gid, AT_SYMLINK_NOFOLLOW);
         regain();
     }
 
@@ -641,29 +2709,27 @@ static int upfs_chown(const char *path, uid_t uid, gid_t gid)
     return 0;
 }
 
-static int upfs_truncate(const char *path, off_t length)
+static int upfs_truncate(struct upfs_loc *loc, off_t length)
 {
     int ret;
     int perm_fd = -1, store_fd = -1;
     int save_errno;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
 
     drop();
-    perm_fd = UPFS(openat)(perm_root, ppath, O_RDWR, 0);
+    perm_fd = UPFS(openat)(loc->perm_dir, loc->ppath, O_RDWR, 0);
     regain();
     if (perm_fd < 0 && errno != ENOENT) return -errno;
 
-    store_fd = openat(store_root, spath, O_RDWR);
+    store_fd = openat(loc->store_dir, loc->spath, O_RDWR);
     if (store_fd < 0) goto error;
 
     if (perm_fd < 0) {
         struct stat sbuf;
-        ret = fstatat(store_root, spath, &sbuf, 0);
-        if (ret < 0) return -errno;
+        ret = fstatat(loc->store_dir, loc->spath, &sbuf, 0);
+        if (ret < 0) goto error;
         drop();
-        mkfull(ppath, &sbuf);
-        perm_fd = UPFS(openat)(perm_root, ppath, O_RDWR, 0);
+        mkfull(loc, &sbuf);
+        perm_fd = UPFS(openat)(loc->perm_dir, loc->ppath, O_RDWR, 0);
         regain();
     }
 
@@ -683,19 +2749,158 @@ error:
     return -save_errno;
 }
 
-static int upfs_open(const char *path, struct fuse_file_info *ffi)
+static int upfs_ftruncate(off_t length, struct fuse_file_info *ffi)
+{
+    int ret;
+    struct upfs_file *file = get_file(ffi);
+
+    ret = ftruncate(file->store_fd, length);
+    if (ret < 0) return -errno;
+    file_touch(file);
+
+    return 0;
+}
+
+static int upfs_utimens(struct upfs_loc *loc, const struct timespec times[2])
+{
+    int perm_ret, store_ret;
+    struct stat sbuf;
+
+    drop();
+    perm_ret = UPFS(utimensat)(loc->perm_dir, loc->ppath, times, AT_SYMLINK_NOFOLLOW);
+    regain();
+    if (perm_ret < 0 && errno != ENOENT) return -errno;
+
+    store_ret = fstatat(loc->store_dir, loc->spath, &sbuf, 0);
+    if (store_ret < 0) return -errno;
+
+    if (perm_ret < 0) {
+        drop();
+        mkfull(loc, &sbuf);
+        perm_ret = UPFS(utimensat)(loc->perm_dir, loc->ppath, times, AT_SYMLINK_NOFOLLOW);
+        regain();
+    }
+    if (perm_ret < 0) return -errno;
+
+    return 0;
+}
+
+static void upfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+    int to_set, struct fuse_file_info *ffi)
+{
+    int ret = 0;
+    struct stat sbuf;
+    struct upfs_loc loc;
+    begin(req);
+
+    ret = node_loc(get_node(ino), &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    ret = may_setattr(&loc, attr, &to_set, ffi);
+
+    /* The owner first, as that may take away bits of the mode */
+    if (!ret && (to_set & (FUSE_SET_ATTR_UID|FUSE_SET_ATTR_GID))) {
+        uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+        gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+        ret = upfs_chown(&loc, uid, gid);
+    }
+
+    if (!ret && (to_set & FUSE_SET_ATTR_MODE))
+        ret = upfs_chmod(&loc, attr->st_mode);
+
+    if (!ret && (to_set & FUSE_SET_ATTR_SIZE)) {
+        if (ffi)
+            ret = upfs_ftruncate(attr->st_size, ffi);
+        else
+            ret = upfs_truncate(&loc, attr->st_size);
+    }
+
+    if (!ret && (to_set & (FUSE_SET_ATTR_ATIME|FUSE_SET_ATTR_MTIME))) {
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = 0;
+        times[0].tv_nsec = times[1].tv_nsec = UTIME_OMIT;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+            times[0].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_ATIME)
+            times[0] = attr->st_atim;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+            times[1].tv_nsec = UTIME_NOW;
+        else if (to_set & FUSE_SET_ATTR_MTIME)
+            times[1] = attr->st_mtim;
+        if (to_set & FUSE_SET_ATTR_MTIME)
+            node_forget_mtime(get_node(ino));
+        ret = upfs_utimens(&loc, times);
+    }
+
+    /* Reply with the new attributes */
+    if (!ret) {
+        loc_inval_aliases(&loc, 0);
+        if (ffi)
+            ret = upfs_fgetattr(&loc, &sbuf, ffi);
+        else
+            ret = upfs_stat(loc.perm_dir, loc.store_dir, loc.ppath, loc.spath, &sbuf);
+    }
+    loc_release(&loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    node_mtime(get_node(ino), &sbuf);
+    sbuf.st_ino = ino;
+    fuse_reply_attr(req, &sbuf, upfs_opts.attr_timeout);
+}
+
+/* The flags to open the store side with. With the writeback cache, the kernel
+ * reads pages to fill in partial writes, even through write-only files, and
+ * decides itself where appends go. */
+static int store_flags(int flags)
+{
+    if (upfs_opts.writeback_cache) {
+        if ((flags & O_ACCMODE) == O_WRONLY)
+            flags = (flags & ~O_ACCMODE) | O_RDWR;
+        flags &= ~O_APPEND;
+    }
+    return flags;
+}
+
+static void upfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *ffi)
 {
     int ret;
     int perm_fd = -1, store_fd = -1;
     int save_errno;
     struct stat sbuf;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
+    struct upfs_file *file;
+    struct upfs_loc loc;
+    begin(req);
+
+    ret = node_loc(get_node(ino), &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    ret = may_loc(&loc, open_mode(ffi->flags));
+    if (ret < 0) {
+        loc_release(&loc);
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    file = file_new(ffi->flags);
+    if (!file) {
+        loc_release(&loc);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
     drop();
-    perm_fd = UPFS(openat)(perm_root, ppath, ffi->flags, 0);
+    perm_fd = UPFS(openat)(loc.perm_dir, loc.ppath, ffi->flags, 0);
     regain();
-    if (perm_fd < 0 && errno != ENOENT) return -errno;
+    if (perm_fd < 0 && errno != ENOENT) goto error;
 
     /* If this is a special file of any kind, use perm_fd directly */
     if (perm_fd >= 0) {
@@ -705,238 +2910,534 @@ static int upfs_open(const char *path, struct fuse_file_info *ffi)
             if (store_fd < 0) goto error;
             ffi->direct_io = 1;
             ffi->nonseekable = 1;
+            file->special = 1;
         }
     }
 
     if (store_fd < 0) {
-        store_fd = openat(store_root, spath, ffi->flags, 0);
+        store_fd = openat(loc.store_dir, loc.spath, store_flags(ffi->flags), 0);
         if (store_fd < 0) goto error;
     }
 
     if (perm_fd < 0) {
         struct stat sbuf;
-        ret = fstatat(store_root, spath, &sbuf, 0);
+        ret = fstatat(loc.store_dir, loc.spath, &sbuf, 0);
         if (ret < 0) goto error;
+
+        /* Reading doesn't claim it, but is allowed as the attributes
+         * reflected from the store say */
+        if ((ffi->flags & O_ACCMODE) == O_RDONLY && !(ffi->flags & O_TRUNC)) {
+#ifndef UPFS_PS
+            if (!upfs_opts.default_permissions) {
+                ret = may(&sbuf, R_OK);
+                if (ret < 0) {
+                    errno = -ret;
+                    goto error;
+                }
+            }
+#endif
+            UPFS_COUNT(claim_avoided);
+            goto opened;
+        }
+
         drop();
-        mkfull(ppath, &sbuf);
-        perm_fd = UPFS(openat)(perm_root, ppath, ffi->flags, 0);
+        mkfull(&loc, &sbuf);
+        perm_fd = UPFS(openat)(loc.perm_dir, loc.ppath, ffi->flags, 0);
         regain();
+
+        /* It's now owned by whoever claimed it */
+        inval_queue(ino, NULL);
+        loc_inval_aliases(&loc, 0);
     }
     if (perm_fd < 0) goto error;
 
-    ffi->fh = ((uint64_t) perm_fd << 32) + store_fd;
-    return 0;
+opened:
+    loc_release(&loc);
+    file->perm_fd = perm_fd;
+    file->store_fd = store_fd;
+    file_attach(file, ino);
+    ffi->fh = (uintptr_t) file;
+    fuse_reply_open(req, ffi);
+    return;
 
 error:
     save_errno = errno;
     if (perm_fd >= 0) close(perm_fd);
     if (store_fd >= 0) close(store_fd);
-    return -save_errno;
+    file_free(file);
+    loc_release(&loc);
+    fuse_reply_err(req, save_errno);
 }
 
-static int upfs_read(const char *ignore, char *buf, size_t size, off_t offset,
-    struct fuse_file_info *ffi)
+static void upfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+    off_t offset, struct fuse_file_info *ffi)
 {
     int ret;
-    int fd;
+    char *buf;
+    struct upfs_file *file = get_file(ffi);
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    begin(req);
+
+    /* When FUSE reads it, we don't learn how much there was, so reads are
+     * counted by what was asked for */
+    UPFS_COUNT_N(read_requested_bytes, size);
+
+    if (!file->special) {
+        /* Let FUSE read (or splice) it straight from the store */
+        bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv.buf[0].fd = file->store_fd;
+        bufv.buf[0].pos = offset;
+
+        fuse_reply_data(req, &bufv, 0);
+        return;
+    }
 
-    if (!ffi) return -ENOTSUP;
+    /* Special files may block or come up short, so read them ourselves */
+    buf = malloc(size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-    fd = (ffi->fh & (uint32_t) -1);
-    if (ffi->nonseekable)
-        ret = read(fd, buf, size);
+    ret = read(file->store_fd, buf, size);
+    if (ret < 0)
+        fuse_reply_err(req, errno);
     else
-        ret = pread(fd, buf, size, offset);
-    if (ret < 0) return -errno;
+        fuse_reply_buf(req, buf, ret);
 
-    return ret;
+    free(buf);
 }
 
-static int upfs_write(const char *ignore, const char *buf, size_t size,
-    off_t offset, struct fuse_file_info *ffi)
+static void upfs_write_buf(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_bufvec *in_buf, off_t offset, struct fuse_file_info *ffi)
 {
-    int ret;
-    int perm_fd, store_fd;
+    ssize_t ret;
+    struct upfs_file *file = get_file(ffi);
+    struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
+    begin(req);
+    UPFS_COUNT(write);
+
+    /* The data may be in memory or, if the kernel spliced it to us, in a pipe;
+     * either way, FUSE can move it to the store */
+    out_buf.buf[0].flags = FUSE_BUF_IS_FD;
+    out_buf.buf[0].fd = file->store_fd;
+    if (!file->special) {
+        out_buf.buf[0].flags |= FUSE_BUF_FD_SEEK;
+        out_buf.buf[0].pos = offset;
+    }
 
-    if (!ffi) return -ENOTSUP;
+    ret = fuse_buf_copy(&out_buf, in_buf,
+        upfs_opts.splice ? 0 : FUSE_BUF_NO_SPLICE);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    UPFS_COUNT_N(write_bytes, ret);
+    file_touch(file);
+
+    fuse_reply_write(req, ret);
+}
+
+static void upfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs sbuf;
+    int ret;
+    begin(req);
 
-    perm_fd = ffi->fh >> 32;
-    (void) perm_fd;
-    store_fd = (ffi->fh & (uint32_t) -1);
-    if (ffi->nonseekable)
-        ret = write(store_fd, buf, size);
+    ret = fstatvfs(store_root, &sbuf);
+    if (ret < 0)
+        fuse_reply_err(req, errno);
     else
-        ret = pwrite(store_fd, buf, size, offset);
-    if (ret < 0) return -errno;
+        fuse_reply_statfs(req, &sbuf);
+}
 
-#ifndef UPFS_PS
-    /* For performance reasons, with permissions in store we do this only once,
-     * at the end */
-    futimens(perm_fd, NULL);
-#endif
+static void upfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *ffi)
+{
+    int ret;
+    int fd;
+    begin(req);
 
-    return ret;
+    file_publish_mtime(get_file(ffi));
+    fd = get_file(ffi)->store_fd;
+    fd = dup(fd);
+    if (fd < 0) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    ret = close(fd);
+    fuse_reply_err(req, (ret < 0) ? errno : 0);
 }
 
-static int upfs_statfs(const char *ignore, struct statvfs *sbuf)
+static void upfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *ffi)
 {
-    int ret = fstatvfs(store_root, sbuf);
-    if (ret < 0) return -errno;
-    return ret;
+    struct upfs_file *file = get_file(ffi);
+    begin(req);
+
+    file_publish_mtime(file);
+    file_free(file);
+
+    fuse_reply_err(req, 0);
 }
 
-static int upfs_flush(const char *ignore, struct fuse_file_info *ffi)
+static void upfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+    struct fuse_file_info *ffi)
 {
+    struct upfs_file *file = get_file(ffi);
+    double start = now();
     int ret;
-    int fd;
+    begin(req);
 
-    if (!ffi) return -ENOTSUP;
+    /* First the data */
+    file_publish_mtime(file);
+    ret = group_sync(file->store_fd, datasync);
 
-    fd = (ffi->fh & (uint32_t) -1);
-    fd = dup(fd);
-    if (fd < 0) return -errno;
-    ret = close(fd);
-    if (ret < 0) return -errno;
+#ifdef UPFS_PS
+    /* Then our entry in the permissions table, which is just data to it. The
+     * table may have been rewritten since we opened it, so go by name. */
+    if (!ret) {
+        struct upfs_loc loc;
+        int tbl_fd;
+
+        ret = node_loc(get_node(ino), &loc);
+        if (!ret) {
+            tbl_fd = UPFS(openat)(loc.perm_dir, loc.ppath, O_RDONLY, 0);
+            if (tbl_fd >= 0) {
+                ret = group_sync(tbl_fd, 1);
+                close(tbl_fd);
+            } else if (errno != ENOENT) {
+                ret = -errno;
+            }
+            loc_release(&loc);
+        }
+    }
 
-    return 0;
+#else
+    /* Then the ownership and mode, and the name they're under, unless it was
+     * opened for reading without being claimed */
+    if (!ret && file->perm_fd >= 0)
+        ret = group_sync(file->perm_fd, 0);
+    if (!ret && file->perm_fd >= 0) {
+        struct upfs_loc loc;
+        char *slash;
+        int dir_fd;
+
+        ret = node_loc(get_node(ino), &loc);
+        if (!ret) {
+            slash = strrchr(loc.ppath, '/');
+            if (slash) {
+                *slash = 0;
+                dir_fd = openat(loc.perm_dir, loc.ppath, O_RDONLY|O_DIRECTORY);
+            } else {
+                dir_fd = dup(loc.perm_dir);
+            }
+            if (dir_fd < 0) {
+                ret = -errno;
+            } else {
+                ret = group_sync(dir_fd, 0);
+                close(dir_fd);
+            }
+            loc_release(&loc);
+        }
+    }
+
+#endif
+    UPFS_TIME(fsync_us, now() - start);
+    fuse_reply_err(req, -ret);
 }
 
-static int upfs_release(const char *ignore, struct fuse_file_info *ffi)
+static void upfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *ffi)
 {
-    int perm_fd, store_fd;
+    int save_errno;
+    int ret;
+    int store_fd = -1;
+    struct upfs_dir *d;
+    struct upfs_loc loc;
+    begin(req);
+
+    d = calloc(1, sizeof(struct upfs_dir));
+    if (!d) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    d->perm_fd = -1;
 
-    if (!ffi) return -ENOTSUP;
+    ret = node_loc(get_node(ino), &loc);
+    if (ret == 0) {
+        ret = may_loc(&loc, R_OK);
+        if (ret < 0)
+            loc_release(&loc);
+    }
+    if (ret < 0) {
+        free(d);
+        fuse_reply_err(req, -ret);
+        return;
+    }
 
-    perm_fd = ffi->fh >> 32;
-    store_fd = (ffi->fh & (uint32_t) -1);
-    if (ffi->flags & O_WRONLY)
-        UPFS(futimens)(perm_fd, NULL);
-    close(perm_fd);
-    close(store_fd);
+    /* Check permissions */
+    drop();
+    d->perm_fd = UPFS(openat)(loc.perm_dir, loc.ppath, O_RDONLY|O_DIRECTORY, 0);
+    regain();
+    if (d->perm_fd < 0 && errno != ENOENT) goto error;
 
-    return 0;
+    /* Open the store directory */
+    store_fd = openat(loc.store_dir, loc.spath, O_RDONLY|O_DIRECTORY, 0);
+    if (store_fd < 0) goto error;
+
+    d->dh = fdopendir(store_fd);
+    if (!d->dh) goto error;
+    d->store_fd = store_fd;
+
+    loc_release(&loc);
+    ffi->fh = (uintptr_t) d;
+    fuse_reply_open(req, ffi);
+    return;
+
+error:
+    save_errno = errno;
+    if (d->perm_fd >= 0) close(d->perm_fd);
+    if (store_fd >= 0) close(store_fd);
+    free(d);
+    loc_release(&loc);
+    fuse_reply_err(req, save_errno);
 }
 
-static int upfs_fsync(const char *ignore, int datasync, struct fuse_file_info *ffi)
+/* Is this name . or ..? */
+static int is_dot_or_dotdot(const char *name)
 {
-    int fd, ret;
-
-    if (!ffi) return -ENOTSUP;
+    return name[0] == '.' &&
+        (!name[1] || (name[1] == '.' && !name[2]));
+}
 
-    fd = (ffi->fh & (uint32_t) -1);
-    if (datasync)
-        ret = fdatasync(fd);
-    else
-        ret = fsync(fd);
+/* Read a directory, with attributes and entries if plus is set. We resume
+ * from wherever the kernel's last buffer filled up, so each call costs only
+ * as much as the entries it returns. */
+#ifdef UPFS_PS
+/* Stat an entry being listed, with its permissions from the table the
+ * listing read. A plain listing only needs the type, which the table has, so
+ * claimed files only go to the store for a full listing. */
+static int upfs_stat_listed(struct upfs_table *table, int store_dirfd,
+    const char *path, struct dirent *entry, struct stat *sbuf, int full)
+{
+    if (upfs_table_fstatat(table, path, sbuf) == 0) {
+        if (!full)
+            return 0;
+        return upfs_stat_store(store_dirfd, entry->d_name, sbuf);
+    }
+    if (errno != ENOENT)
+        return -errno;
 
-    if (ret < 0) return -errno;
+    /* Unclaimed, so it's all the store's */
+    if (fstatat(store_dirfd, entry->d_name, sbuf, 0) < 0)
+        return -errno;
     return 0;
 }
+#endif
 
-static int upfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-    off_t offset, struct fuse_file_info *ffi)
+static void upfs_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+    off_t offset, struct fuse_file_info *ffi, int plus)
 {
-    int save_errno;
     int ret;
-    int perm_fd = -1, store_fd = -1, store_fd2 = -1;
-    DIR *dh = NULL;
-    struct dirent *de;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
+    struct upfs_dir *d = get_dir(ffi);
+    char *buf;
+    size_t buf_used = 0, ent_sz;
+    off_t next_offset;
+    struct upfs_node *dir = get_node(ino), *node;
+    struct fuse_entry_param e;
+    begin(req);
+
+    buf = malloc(size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-    /* Check permissions */
-    drop();
-    perm_fd = UPFS(openat)(perm_root, ppath, O_RDONLY|O_DIRECTORY, 0);
-    regain();
-    if (perm_fd < 0 && errno != ENOENT) return -errno;
+    /* Go to where the kernel wants us, if we aren't already there */
+    if (offset != d->offset) {
+        seekdir(d->dh, offset);
+        d->entry = NULL;
+        d->offset = offset;
+    }
 
-    /* Open the store directory */
-    store_fd = openat(store_root, spath, O_RDONLY, 0);
-    if (store_fd < 0) goto error;
+#ifdef UPFS_PS
+    /* Join the listing against the table, rather than reading the table for
+     * each entry. If we can't, just do that. */
+    if (d->perm_fd >= 0 && upfs_table_refresh(&d->table, d->perm_fd) < 0) {
+        upfs_table_free(d->table);
+        d->table = NULL;
+    }
+#endif
 
-    /* Prepare for readdir */
-    store_fd2 = dup(store_fd);
-    if (store_fd2 < 0) goto error;
+    while (1) {
+        struct stat *sbuf = &e.attr;
+        char pd_name[NAME_MAX], pp_name[PATH_MAX];
 
-    dh = fdopendir(store_fd2);
-    if (!dh) goto error;
-    store_fd2 = -1;
+        if (!d->entry) {
+            errno = 0;
+            d->entry = readdir(d->dh);
+            if (!d->entry) {
+                ret = -errno;
+                break;
+            }
+        }
+        next_offset = d->entry->d_off;
 
-    /* And read it */
-    while ((de = readdir(dh)) != NULL) {
-        struct stat sbuf;
-        char pd_name[NAME_MAX];
 #ifdef UPFS_PS
-        /* Skip the metafile */
-        if (!strcmp(de->d_name, UPFS_META_FILE))
+        /* Skip the metafiles */
+        if (UPFS_IS_META_FILE(d->entry->d_name)) {
+            d->entry = NULL;
+            d->offset = next_offset;
             continue;
+        }
 #endif
 
-#ifdef UPFS_FATNAMES
         /* Convert the name back from mangling */
-        {
-            int o, i;
-            for (o = i = 0;
-                 de->d_name[i] && o < NAME_MAX - 1;
-                 i++) {
-                char c = de->d_name[i];
-                if (c == '$' && de->d_name[i+1] && de->d_name[i+2]) {
-                    char h[3];
-                    h[0] = de->d_name[i+1];
-                    h[1] = de->d_name[i+2];
-                    h[2] = 0;
-                    c = strtol(h, NULL, 16);
-                    i += 2;
+        upfs_path_from_store(pd_name, d->entry->d_name);
+
+        memset(&e, 0, sizeof(struct fuse_entry_param));
+#ifdef UPFS_PS
+        if (d->table) {
+            upfs_perm_path(pp_name, pd_name);
+            ret = upfs_stat_listed(d->table, d->store_fd, pp_name,
+                d->entry, sbuf, plus);
+        } else
+#endif
+        if (d->perm_fd >= 0) {
+            upfs_perm_path(pp_name, pd_name);
+            ret = upfs_stat(d->perm_fd, d->store_fd, pp_name,
+                d->entry->d_name, sbuf);
+        } else {
+            ret = fstatat(d->store_fd, d->entry->d_name, sbuf, 0);
+            if (ret < 0) ret = -errno;
+        }
+        if (ret == -ENOENT) {
+            /* Removed since we read it */
+            d->entry = NULL;
+            d->offset = next_offset;
+            continue;
+        }
+        if (ret < 0)
+            break;
+
+        if (!plus) {
+            ent_sz = fuse_add_direntry(req, buf + buf_used, size - buf_used,
+                pd_name, sbuf, next_offset);
+            if (ent_sz > size - buf_used)
+                break;
+
+        } else {
+            /* The kernel takes a lookup reference on all but . and .. */
+            node = NULL;
+            if (!is_dot_or_dotdot(pd_name)) {
+                pthread_mutex_lock(&nodes_lock);
+                node = node_get(dir, pd_name);
+                pthread_mutex_unlock(&nodes_lock);
+                if (!node) {
+                    ret = -ENOMEM;
+                    break;
                 }
-                pd_name[o++] = c;
+                e.ino = node_ino(node);
+                e.attr.st_ino = e.ino;
+                e.attr_timeout = upfs_opts.attr_timeout;
+                e.entry_timeout = upfs_opts.entry_timeout;
             }
-            pd_name[o] = 0;
-        }
-#endif
 
-        if (perm_fd >= 0) {
-            ret = upfs_stat(perm_fd, store_fd, pd_name, de->d_name, &sbuf);
-            if (ret < 0) {
-                errno = -ret;
-                goto error;
+            ent_sz = fuse_add_direntry_plus(req, buf + buf_used,
+                size - buf_used, pd_name, &e, next_offset);
+            if (ent_sz > size - buf_used) {
+                /* It didn't make it to the kernel, so drop the reference */
+                if (node) {
+                    pthread_mutex_lock(&nodes_lock);
+                    node_unref(node, 1);
+                    pthread_mutex_unlock(&nodes_lock);
+                }
+                break;
             }
-        } else {
-            ret = fstatat(store_fd, de->d_name, &sbuf, 0);
-            if (ret < 0) goto error;
+
         }
-        if (filler(buf, pd_name, &sbuf, 0))
-            break;
+
+        /* This entry is the kernel's now. If it doesn't fit, we keep it for
+         * the next call instead. */
+        buf_used += ent_sz;
+        d->entry = NULL;
+        d->offset = next_offset;
     }
 
-    /* Then clean up */
-    closedir(dh);
-    close(store_fd);
-    if (perm_fd >= 0)
-        close(perm_fd);
-    return 0;
+    /* Report errors only if we have nothing else to say */
+    if (ret < 0 && buf_used == 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_buf(req, buf, buf_used);
+    free(buf);
+}
 
-error:
-    save_errno = errno;
-    if (perm_fd >= 0) close(perm_fd);
-    if (store_fd >= 0) close(store_fd);
-    if (store_fd2 >= 0) close(store_fd2);
-    if (dh) closedir(dh);
-    return -save_errno;
+static void upfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+    off_t offset, struct fuse_file_info *ffi)
+{
+    UPFS_COUNT(readdir);
+    upfs_do_readdir(req, ino, size, offset, ffi, 0);
+}
+
+static void upfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+    off_t offset, struct fuse_file_info *ffi)
+{
+    UPFS_COUNT(readdirplus);
+    upfs_do_readdir(req, ino, size, offset, ffi, 1);
+}
+
+static void upfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *ffi)
+{
+    struct upfs_dir *d = get_dir(ffi);
+    begin(req);
+
+    closedir(d->dh);
+    if (d->perm_fd >= 0)
+        close(d->perm_fd);
+#ifdef UPFS_PS
+    upfs_table_free(d->table);
+#endif
+    free(d);
+    fuse_reply_err(req, 0);
 }
 
-static int upfs_access(const char *path, int mode)
+static void upfs_access(fuse_req_t req, fuse_ino_t ino, int mode)
 {
     int ret;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
+    struct upfs_loc loc;
+    begin(req);
 
-#ifndef UPFS_PS
-    /* If we were using permission files in the store, we should be using
-     * default_permissions, and if not, everything goes */
-    drop();
-    ret = UPFS(faccessat)(perm_root, ppath, mode, AT_EACCESS);
-    regain();
-    if (ret < 0 && errno != ENOENT) return -errno;
+    ret = node_loc(get_node(ino), &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+#ifdef UPFS_PS
+    /* With default_permissions, the kernel doesn't ask */
+    ret = -may_loc(&loc, mode);
+    if (ret)
+        goto done;
+
+#else
+    if (upfs_opts.user_access) {
+        /* Judge the perm side's attributes ourselves, so that the caller's
+         * credentials needn't be switched to and back */
+        struct stat sbuf;
+        ret = fstatat(loc.perm_dir, loc.ppath, &sbuf, 0);
+        if (ret == 0)
+            ret = -may(&sbuf, mode);
+        else
+            ret = (errno == ENOENT) ? 0 : errno;
+        if (ret)
+            goto done;
+    } else {
+        drop();
+        ret = UPFS(faccessat)(loc.perm_dir, loc.ppath, mode, AT_EACCESS);
+        regain();
+        if (ret < 0 && errno != ENOENT) {
+            ret = errno;
+            goto done;
+        }
+    }
 #endif
 
     /* Don't check execute bit on store FS */
@@ -944,129 +3445,150 @@ static int upfs_access(const char *path, int mode)
         mode &= ~(X_OK);
         if (!mode) mode = R_OK;
     }
-    ret = faccessat(store_root, spath, mode, 0);
-    if (ret < 0) return -errno;
-    return 0;
+    ret = faccessat(loc.store_dir, loc.spath, mode, 0);
+    ret = (ret < 0) ? errno : 0;
+
+done:
+    loc_release(&loc);
+    fuse_reply_err(req, ret);
 }
 
-static int upfs_create(const char *path, mode_t mode,
-    struct fuse_file_info *ffi)
+static void upfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+    mode_t mode, struct fuse_file_info *ffi)
 {
+    int ret;
     int perm_fd = -1, store_fd = -1;
     int save_errno;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
+    struct upfs_node *dir = get_node(parent);
+    struct upfs_file *file = NULL;
+    struct upfs_loc loc;
+    struct fuse_entry_param e;
+    begin(req);
+
+    ret = child_loc(dir, name, &loc);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    ret = may_node(dir, W_OK|X_OK);
+    if (ret < 0) {
+        errno = -ret;
+        goto error;
+    }
+
+    file = file_new(ffi->flags);
+    if (!file) goto error;
 
     drop();
-    perm_fd = UPFS(openat)(perm_root, ppath, O_RDWR|O_CREAT|O_EXCL, mode);
+    perm_fd = UPFS(openat)(loc.perm_dir, loc.ppath, O_RDWR|O_CREAT|O_EXCL, mode);
     regain();
-    if (perm_fd < 0) return -errno;
+    if (perm_fd < 0) goto error;
 
-    store_fd = openat(store_root, spath, O_RDWR|O_CREAT|O_EXCL, 0600);
+    store_fd = openat(loc.store_dir, loc.spath,
+        store_flags(O_RDWR|O_CREAT|O_EXCL|(ffi->flags & O_APPEND)), 0600);
     if (store_fd < 0) goto error;
 
-    ffi->fh = ((uint64_t) perm_fd << 32) + store_fd;
-    return 0;
+    ret = upfs_entry(dir, name, &loc, &e);
+    if (ret < 0) {
+        errno = -ret;
+        goto error;
+    }
+
+    loc_neg_clear(&loc);
+    loc_release(&loc);
+    file->perm_fd = perm_fd;
+    file->store_fd = store_fd;
+    file_attach(file, e.ino);
+    ffi->fh = (uintptr_t) file;
+    fuse_reply_create(req, &e, ffi);
+    return;
 
 error:
     save_errno = errno;
     if (perm_fd >= 0) close(perm_fd);
     if (store_fd >= 0) close(store_fd);
-    return -save_errno;
-}
-
-static int upfs_ftruncate(const char *ignore, off_t length, struct fuse_file_info *ffi)
-{
-    int perm_fd, store_fd, ret;
-
-    if (!ffi) return -ENOTSUP;
-
-    perm_fd = ffi->fh >> 32;
-    (void) perm_fd;
-    store_fd = (ffi->fh & (uint32_t) -1);
-    ret = ftruncate(store_fd, length);
-    if (ret < 0) return -errno;
-#ifndef UPFS_PS
-    UPFS(futimens)(perm_fd, NULL);
-#endif
-
-    return 0;
+    file_free(file);
+    loc_neg_clear(&loc);
+    loc_release(&loc);
+    fuse_reply_err(req, save_errno);
 }
 
-static int upfs_fgetattr(const char *path, struct stat *sbuf, struct fuse_file_info *ffi)
+static void upfs_getlk(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *ffi, struct flock *fl)
 {
-#ifdef UPFS_PS
-    /* We just have to stat the path and hope it hasn't been changed */
-    return upfs_getattr(path, sbuf);
-
-#else
-    int perm_fd, store_fd;
     int ret;
-    struct stat store_buf;
-
-    if (!ffi) return -ENOTSUP;
-
-    perm_fd = ffi->fh >> 32;
-    store_fd = (ffi->fh & (uint32_t) -1);
-
-    ret = fstat(perm_fd, sbuf);
-    if (ret < 0) return -errno;
-
-    if (S_ISREG(sbuf->st_mode)) {
-        ret = fstat(store_fd, &store_buf);
-        if (ret < 0) return -errno;
-        sbuf->st_size = store_buf.st_size;
-        sbuf->st_blksize = store_buf.st_blksize;
-        sbuf->st_blocks = store_buf.st_blocks;
-    }
-
-#endif
+    begin(req);
 
-    return 0;
+    ret = fcntl(get_file(ffi)->store_fd, F_GETLK, fl);
+    if (ret < 0)
+        fuse_reply_err(req, errno);
+    else
+        fuse_reply_lock(req, fl);
 }
 
-static int upfs_lock(const char *ignore, struct fuse_file_info *ffi, int cmd,
-    struct flock *fl)
+static void upfs_setlk(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *ffi, struct flock *fl, int sleep)
 {
-    int fd, ret;
-
-    if (!ffi) return -ENOTSUP;
-
-    fd = (ffi->fh & (uint32_t) -1);
-    ret = fcntl(fd, cmd, fl);
-    if (ret < 0) return -errno;
+    int ret;
+    begin(req);
 
-    return 0;
+    ret = fcntl(get_file(ffi)->store_fd, sleep ? F_SETLKW : F_SETLK, fl);
+    fuse_reply_err(req, (ret < 0) ? errno : 0);
 }
 
-static int upfs_utimens(const char *path, const struct timespec times[2])
+/* Tell the kernel how we'd like to be spoken to */
+static void upfs_init(void *userdata, struct fuse_conn_info *conn)
 {
-    int perm_ret, store_ret;
-    struct stat sbuf;
-    char ppath[PATH_MAX], spath[PATH_MAX];
-    correct_path(path, ppath, spath);
+    /* Take writes in large pieces. libfuse limits this to what its buffers
+     * can hold, and asks the kernel for enough pages per request. */
+    if (upfs_opts.max_write)
+        conn->max_write = upfs_opts.max_write;
+
+    /* Let the kernel gather small writes, if asked */
+    if (upfs_opts.writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    else
+        upfs_opts.writeback_cache = 0;
+
+    /* Move file data through pipes rather than our own buffers */
+    if (upfs_opts.splice) {
+        conn->want |= conn->capable &
+            (FUSE_CAP_SPLICE_READ|FUSE_CAP_SPLICE_WRITE|FUSE_CAP_SPLICE_MOVE);
+    } else {
+        conn->want &=
+            ~(FUSE_CAP_SPLICE_READ|FUSE_CAP_SPLICE_WRITE|FUSE_CAP_SPLICE_MOVE);
+    }
 
-    drop();
-    perm_ret = UPFS(utimensat)(perm_root, ppath, times, AT_SYMLINK_NOFOLLOW);
-    regain();
-    if (perm_ret < 0 && errno != ENOENT) return -errno;
+    switch (upfs_opts.readdirplus) {
+        case UPFS_READDIRPLUS_NO:
+            conn->want &= ~(FUSE_CAP_READDIRPLUS|FUSE_CAP_READDIRPLUS_AUTO);
+            break;
 
-    store_ret = fstatat(store_root, spath, &sbuf, 0);
-    if (store_ret < 0) return -errno;
+        case UPFS_READDIRPLUS_YES:
+            /* Always send attributes, even when nobody asks for them */
+            if (conn->capable & FUSE_CAP_READDIRPLUS)
+                conn->want |= FUSE_CAP_READDIRPLUS;
+            conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+            break;
 
-    if (perm_ret < 0) {
-        drop();
-        mkfull(ppath, &sbuf);
-        perm_ret = UPFS(utimensat)(perm_root, ppath, times, AT_SYMLINK_NOFOLLOW);
-        regain();
+        default:
+            /* Let the kernel decide, based on whether listings are followed
+             * by lookups */
+            if (conn->capable & FUSE_CAP_READDIRPLUS)
+                conn->want |= FUSE_CAP_READDIRPLUS;
+            if (conn->capable & FUSE_CAP_READDIRPLUS_AUTO)
+                conn->want |= FUSE_CAP_READDIRPLUS_AUTO;
     }
-    if (perm_ret < 0) return -errno;
-
-    return 0;
 }
 
-static struct fuse_operations upfs_operations = {
+static struct fuse_lowlevel_ops upfs_operations = {
+    .init = upfs_init,
+    .lookup = upfs_lookup,
+    .forget = upfs_forget,
+    .forget_multi = upfs_forget_multi,
     .getattr = upfs_getattr,
+    .setattr = upfs_setattr,
     .readlink = upfs_readlink,
     .mknod = upfs_mknod,
     .mkdir = upfs_mkdir,
@@ -1077,30 +3599,112 @@ static struct fuse_operations upfs_operations = {
 #ifdef UPFS_LNCP
     .link = upfs_lncp,
 #endif
-    .chmod = upfs_chmod,
-    .chown = upfs_chown,
-    .truncate = upfs_truncate,
     .open = upfs_open,
     .read = upfs_read,
-    .write = upfs_write,
+    .write_buf = upfs_write_buf,
     .statfs = upfs_statfs,
     .flush = upfs_flush,
     .release = upfs_release,
     .fsync = upfs_fsync,
+    .opendir = upfs_opendir,
     .readdir = upfs_readdir,
+    .readdirplus = upfs_readdirplus,
+    .releasedir = upfs_releasedir,
     .access = upfs_access,
     .create = upfs_create,
-    .ftruncate = upfs_ftruncate,
-    .fgetattr = upfs_fgetattr,
-    .lock = upfs_lock,
-    .utimens = upfs_utimens
+    .getlk = upfs_getlk,
+    .setlk = upfs_setlk
 };
 
+/* Write out our statistics */
+static void dump_stats(void)
+{
+    FILE *f = stderr;
+
+    if (upfs_opts.stats_file) {
+        f = fopen(upfs_opts.stats_file, "w");
+        if (!f) {
+            perror(upfs_opts.stats_file);
+            return;
+        }
+    }
+
+    upfs_stats_dump(f);
+#ifdef UPFS_PS
+    upfs_table_locks_dump(f);
+#endif
+
+    if (f != stderr)
+        fclose(f);
+    else
+        fflush(f);
+}
+
+/* Dump statistics on SIGUSR1 */
+static void *stats_thread(void *ignore)
+{
+    sigset_t sigs;
+    int sig;
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    while (sigwait(&sigs, &sig) == 0)
+        dump_stats();
+
+    return NULL;
+}
+
+#ifdef UPFS_PS
+/* Look after permissions tables journal_interval seconds after they're
+ * changed, folding in their journals and compacting them, and fold in what's
+ * left of the journals at unmount */
+static pthread_mutex_t tend_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tend_cond = PTHREAD_COND_INITIALIZER;
+static int tend_running = 0;
+
+static void *tend_thread(void *ignore)
+{
+    struct timespec ts;
+    double interval = upfs_opts.journal_interval;
+
+    pthread_mutex_lock(&tend_lock);
+    while (tend_running) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += (time_t) interval;
+        ts.tv_nsec += (long) ((interval - (time_t) interval) * 1e9);
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&tend_cond, &tend_lock, &ts);
+        if (!tend_running)
+            break;
+
+        pthread_mutex_unlock(&tend_lock);
+        upfs_tables_tend(interval, 1);
+        pthread_mutex_lock(&tend_lock);
+    }
+    pthread_mutex_unlock(&tend_lock);
+
+    upfs_tables_tend(0, 0);
+    return NULL;
+}
+#endif
+
 int main(int argc, char **argv)
 {
     char *arg, **fuse_argv;
-    int ai, fai;
+    int ai, fai, ret;
     struct stat sbuf;
+    struct fuse_args args;
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
+    struct fuse_loop_config *loop_config;
+    sigset_t sigs;
+    pthread_t th, inval_th;
+#ifdef UPFS_PS
+    pthread_t tend_th;
+#endif
 
     fuse_argv = calloc(argc + 1, sizeof(char *));
     if (!fuse_argv) {
@@ -1136,7 +3740,21 @@ int main(int argc, char **argv)
         }
     }
 
-    if (!perm_root_path || !store_root_path) {
+    args.argc = fai;
+    args.argv = fuse_argv;
+    args.allocated = 0;
+    if (fuse_opt_parse(&args, &upfs_opts, upfs_opt_spec, upfs_opt_proc) != 0)
+        return 1;
+#ifdef UPFS_PS
+    upfs_table_cache_entries = upfs_opts.table_cache;
+    upfs_journal_max = upfs_opts.journal ? upfs_opts.journal_size : 0;
+    upfs_compact_dead = upfs_opts.compact;
+    upfs_compact_rate = upfs_opts.compact_rate;
+#endif
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+
+    if (!perm_root_path || !store_root_path || !opts.mountpoint) {
 #ifdef UPFS_PS
         fprintf(stderr, "Use: upfs-ps <root> <mount point>\n");
 #else
@@ -1169,8 +3787,93 @@ int main(int argc, char **argv)
 #ifdef UPFS_PS
     perm_root = store_root;
 #endif
+    root_node.perm_fd = perm_root;
+    root_node.store_fd = store_root;
+
+    /* Without default_permissions, our lookups are the only search permission
+     * checks, so the kernel must revalidate every path component with us.
+     * Attributes are safe to cache either way, as we invalidate them when we
+     * change them behind the kernel's back. */
+    if (upfs_opts.entry_timeout < 0)
+        upfs_opts.entry_timeout = upfs_opts.default_permissions ? 60.0 : 0.0;
+    if (upfs_opts.negative_timeout < 0)
+        upfs_opts.negative_timeout = upfs_opts.default_permissions ? 60.0 : 0.0;
 
     /* And run FUSE */
     umask(0);
-    return fuse_main(fai, fuse_argv, &upfs_operations, NULL);
+    se = fuse_session_new(&args, &upfs_operations, sizeof(upfs_operations), NULL);
+    if (!se)
+        return 1;
+    if (fuse_set_signal_handlers(se) != 0)
+        return 1;
+    if (fuse_session_mount(se, opts.mountpoint) != 0)
+        return 1;
+    fuse_daemonize(opts.foreground);
+
+    /* Our own threads, which must be started after daemonizing. SIGUSR1 is
+     * blocked before any others start, so that only its thread sees it. */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    if (pthread_create(&th, NULL, stats_thread, NULL) == 0)
+        pthread_detach(th);
+    upfs_session = se;
+    inval_running = 1;
+    if (pthread_create(&inval_th, NULL, inval_thread, NULL) != 0)
+        inval_running = 0;
+#ifdef UPFS_PS
+    if (upfs_journal_max || upfs_compact_dead) {
+        tend_running = 1;
+        if (pthread_create(&tend_th, NULL, tend_thread, NULL) != 0)
+            tend_running = 0;
+    }
+#endif
+
+    if (opts.singlethread) {
+        ret = fuse_session_loop(se);
+
+    } else {
+        /* Each worker reads from its own clone of the FUSE fd, unless asked
+         * otherwise, so that they don't all contend for one queue */
+        loop_config = fuse_loop_cfg_create();
+        if (!loop_config)
+            return 1;
+        fuse_loop_cfg_set_clone_fd(loop_config,
+            opts.clone_fd || upfs_opts.clone_fd);
+        fuse_loop_cfg_set_idle_threads(loop_config, opts.max_idle_threads);
+        fuse_loop_cfg_set_max_threads(loop_config, opts.max_threads);
+        ret = fuse_session_loop_mt(se, loop_config);
+        fuse_loop_cfg_destroy(loop_config);
+
+    }
+
+    /* Flush any outstanding invalidations */
+    if (inval_running) {
+        pthread_mutex_lock(&inval_lock);
+        inval_running = 0;
+        pthread_cond_signal(&inval_cond);
+        pthread_mutex_unlock(&inval_lock);
+        pthread_join(inval_th, NULL);
+    }
+#ifdef UPFS_PS
+    if (tend_running) {
+        pthread_mutex_lock(&tend_lock);
+        tend_running = 0;
+        pthread_cond_signal(&tend_cond);
+        pthread_mutex_unlock(&tend_lock);
+        pthread_join(tend_th, NULL);
+    } else {
+        upfs_tables_tend(0, 0);
+    }
+#endif
+    if (upfs_opts.stats_file)
+        dump_stats();
+
+    fuse_session_unmount(se);
+    fuse_remove_signal_handlers(se);
+    fuse_session_destroy(se);
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+
+    return ret ? 1 : 0;
 }
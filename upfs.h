@@ -5,6 +5,10 @@
 #include <limits.h>
 #include <string.h>
 
+/* Get the context of the request being served by this thread */
+struct fuse_ctx;
+const struct fuse_ctx *upfs_get_context(void);
+
 /* Split path into dir/file parts */
 static void split_path(const char *path, char path_parts[PATH_MAX],
     char **path_dir, char **path_file, int decap)